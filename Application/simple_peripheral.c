@@ -138,6 +138,17 @@
 // Connection Pause Peripheral time value (in seconds)
 #define DEFAULT_CONN_PAUSE_PERIPHERAL         6
 
+// Connection interval requested while an OTA transfer is running (units of
+// 1.25ms, 6=7.5ms, the shortest the spec allows)
+#define OTA_FAST_CONN_INTERVAL                6
+
+// Slave latency requested while an OTA transfer is running
+#define OTA_FAST_SLAVE_LATENCY                0
+
+// Go back to the default connection parameters when no OTA ack went out
+// for this long (in msec), e.g. because the sender gave up
+#define OTA_FAST_IDLE_TIMEOUT                 5000
+
 // How often to perform periodic event (in msec)
 #define SBP_PERIODIC_EVT_PERIOD               5000
 
@@ -167,6 +178,9 @@
 #ifdef FEATURE_OAD
 // The size of an OAD packet.
 #define OAD_PACKET_SIZE                       ((OAD_BLOCK_SIZE) + 2)
+
+// OAD writes waiting for the application task
+#define OAD_WRITE_BUFS                        8
 #endif // FEATURE_OAD
 
 // Task configuration
@@ -182,6 +196,8 @@
 #define SBP_CHAR_CHANGE_EVT                   0x0002
 #define SBP_PERIODIC_EVT                      0x0004
 #define SBP_CONN_EVT_END_EVT                  0x0008
+#define SBP_PARAM_UPDATE_EVT                  0x0010
+#define SBP_OTA_IDLE_EVT                      0x0020
 
 /*********************************************************************
  * TYPEDEFS
@@ -212,6 +228,13 @@ static ICall_Semaphore sem;
 
 // Clock instances for internal periodic events.
 static Clock_Struct periodicClock;
+static Clock_Struct otaIdleClock;
+
+// Connection parameters asked for and granted, see characteristic 8
+static simpleProfileOtaLink_t otaLink;
+
+// An OTA parameter request was refused because another update was pending
+static uint8_t otaLinkRetry = FALSE;
 
 // Queue object used for app messages
 static Queue_Struct appMsg;
@@ -221,6 +244,22 @@ static Queue_Handle appMsgQueue;
 // Event data from OAD profile.
 static Queue_Struct oadQ;
 static Queue_Handle hOadQ;
+
+// OAD writes are carried in preallocated buffers, taken from the free queue
+// by the write callback and returned by the application task, so a long
+// transfer does not churn the ICall heap.
+typedef struct
+{
+  oadTargetWrite_t evt;
+  uint8_t data[OAD_PACKET_SIZE];
+} oadWriteBuf_t;
+
+static oadWriteBuf_t oadWriteBufs[OAD_WRITE_BUFS];
+static Queue_Struct oadFreeQ;
+static Queue_Handle hOadFreeQ;
+
+// OAD write buffer occupancy
+oadWriteStats_t oadWriteStats;
 #endif //FEATURE_OAD
 
 // events flag for internal application events.
@@ -328,6 +367,11 @@ static void SimpleBLEPeripheral_sendAttRsp(void);
 static void SimpleBLEPeripheral_freeAttRsp(uint8_t status);
 
 static void SimpleBLEPeripheral_stateChangeCB(gaprole_States_t newState);
+static void SimpleBLEPeripheral_paramUpdateCB(uint16_t connInterval,
+                                              uint16_t connSlaveLatency,
+                                              uint16_t connTimeout);
+static void SimpleBLEPeripheral_processParamUpdateEvt(void);
+static void SimpleBLEPeripheral_setOtaFastMode(uint8_t enable);
 #ifndef FEATURE_OAD_ONCHIP
 static void SimpleBLEPeripheral_charValueChangeCB(uint8_t paramID);
 #endif //!FEATURE_OAD_ONCHIP
@@ -349,6 +393,10 @@ static gapRolesCBs_t SimpleBLEPeripheral_gapRoleCBs =
   SimpleBLEPeripheral_stateChangeCB     // Profile State Change Callbacks
 };
 
+// GAP Role Connection Parameter Update Callback
+static gapRolesParamUpdateCB_t SimpleBLEPeripheral_paramUpdateCBs =
+  SimpleBLEPeripheral_paramUpdateCB;
+
 // GAP Bond Manager Callbacks
 static gapBondCBs_t simpleBLEPeripheral_BondMgrCBs =
 {
@@ -446,6 +494,8 @@ static void SimpleBLEPeripheral_init(void)
   // Create one-shot clocks for internal periodic events.
   Util_constructClock(&periodicClock, SimpleBLEPeripheral_clockHandler,
                       SBP_PERIODIC_EVT_PERIOD, 0, false, SBP_PERIODIC_EVT);
+  Util_constructClock(&otaIdleClock, SimpleBLEPeripheral_clockHandler,
+                      OTA_FAST_IDLE_TIMEOUT, 0, false, SBP_OTA_IDLE_EVT);
 
   dispHandle = Display_open(SBP_DISPLAY_TYPE, NULL);
 
@@ -488,6 +538,10 @@ static void SimpleBLEPeripheral_init(void)
                          &desiredSlaveLatency);
     GAPRole_SetParameter(GAPROLE_TIMEOUT_MULTIPLIER, sizeof(uint16_t),
                          &desiredConnTimeout);
+
+    otaLink.minInterval = desiredMinInterval;
+    otaLink.maxInterval = desiredMaxInterval;
+    otaLink.slaveLatency = desiredSlaveLatency;
   }
 
   // Set the GAP Characteristics
@@ -532,6 +586,16 @@ static void SimpleBLEPeripheral_init(void)
   VOID OAD_addService();                 // OAD Profile
   OAD_register((oadTargetCBs_t *)&simpleBLEPeripheral_oadCBs);
   hOadQ = Util_constructQueue(&oadQ);
+  hOadFreeQ = Util_constructQueue(&oadFreeQ);
+  {
+    uint8_t i;
+
+    for (i = 0; i < OAD_WRITE_BUFS; i++)
+    {
+      oadWriteBufs[i].evt.pData = oadWriteBufs[i].data;
+      Queue_put(hOadFreeQ, &oadWriteBufs[i].evt._elem);
+    }
+  }
 #endif //FEATURE_OAD
 
 #ifdef IMAGE_INVALIDATE
@@ -567,6 +631,9 @@ static void SimpleBLEPeripheral_init(void)
   // Start the Device
   VOID GAPRole_StartDevice(&SimpleBLEPeripheral_gapRoleCBs);
 
+  // Follow the connection parameters the central grants
+  GAPRole_RegisterAppCBs(&SimpleBLEPeripheral_paramUpdateCBs);
+
   // Start Bond Manager
   VOID GAPBondMgr_Register(&simpleBLEPeripheral_BondMgrCBs);
 
@@ -674,6 +741,14 @@ static void SimpleBLEPeripheral_taskFxn(UArg a0, UArg a1)
       SimpleBLEPeripheral_performPeriodicTask();
     }
 
+    if (events & SBP_OTA_IDLE_EVT)
+    {
+      events &= ~SBP_OTA_IDLE_EVT;
+
+      // The transfer stalled, stop holding the link at full speed
+      SimpleBLEPeripheral_setOtaFastMode(FALSE);
+    }
+
 #ifdef FEATURE_OAD
     while (!Queue_empty(hOadQ))
     {
@@ -690,8 +765,9 @@ static void SimpleBLEPeripheral_taskFxn(UArg a0, UArg a1)
         OAD_imgBlockWrite(oadWriteEvt->connHandle, oadWriteEvt->pData);
       }
 
-      // Free buffer.
-      ICall_free(oadWriteEvt);
+      // Return the buffer.
+      Queue_put(hOadFreeQ, &oadWriteEvt->_elem);
+      oadWriteStats.freed++;
     }
 #endif //FEATURE_OAD
   }
@@ -780,6 +856,10 @@ static uint8_t SimpleBLEPeripheral_processGATTMsg(gattMsgEvent_t *pMsg)
   {
     // MTU size updated
     Display_print1(dispHandle, 5, 0, "MTU Size: $d", pMsg->msg.mtuEvt.MTU);
+
+    // Let OTA senders use larger chunks
+    SimpleProfile_SetParameter(SIMPLEPROFILE_ATT_MTU, sizeof(uint16_t),
+                               &pMsg->msg.mtuEvt.MTU);
   }
 
   // Free message payload. Needed only for ATT Protocol messages
@@ -885,6 +965,10 @@ static void SimpleBLEPeripheral_processAppMsg(sbpEvt_t *pMsg)
       SimpleBLEPeripheral_processCharValueChangeEvt(pMsg->hdr.state);
       break;
 
+    case SBP_PARAM_UPDATE_EVT:
+      SimpleBLEPeripheral_processParamUpdateEvt();
+      break;
+
     default:
       // Do nothing.
       break;
@@ -905,6 +989,127 @@ static void SimpleBLEPeripheral_stateChangeCB(gaprole_States_t newState)
   SimpleBLEPeripheral_enqueueMsg(SBP_STATE_CHANGE_EVT, newState);
 }
 
+/*********************************************************************
+ * @fn      SimpleBLEPeripheral_paramUpdateCB
+ *
+ * @brief   Callback from GAP Role indicating new connection parameters.
+ *
+ * @param   connInterval - new connection interval
+ * @param   connSlaveLatency - new slave latency
+ * @param   connTimeout - new supervision timeout
+ *
+ * @return  None.
+ */
+static void SimpleBLEPeripheral_paramUpdateCB(uint16_t connInterval,
+                                              uint16_t connSlaveLatency,
+                                              uint16_t connTimeout)
+{
+  // The values are read back from the GAP Role in the application task
+  SimpleBLEPeripheral_enqueueMsg(SBP_PARAM_UPDATE_EVT, 0);
+}
+
+/*********************************************************************
+ * @fn      SimpleBLEPeripheral_processParamUpdateEvt
+ *
+ * @brief   Record the current connection parameters in the OTA link
+ *          diagnostics.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void SimpleBLEPeripheral_processParamUpdateEvt(void)
+{
+  GAPRole_GetParameter(GAPROLE_CONN_INTERVAL, &otaLink.interval);
+  GAPRole_GetParameter(GAPROLE_CONN_LATENCY, &otaLink.latency);
+  GAPRole_GetParameter(GAPROLE_CONN_TIMEOUT, &otaLink.timeout);
+
+#ifndef FEATURE_OAD_ONCHIP
+  SimpleProfile_SetParameter(SIMPLEPROFILE_CHAR8, SIMPLEPROFILE_CHAR8_LEN,
+                             &otaLink);
+#endif //!FEATURE_OAD_ONCHIP
+
+  Display_print2(dispHandle, 5, 0, "Conn Int: %d Lat: %d", otaLink.interval,
+                 otaLink.latency);
+
+  // The update that held back our last request is done, send it now
+  if (otaLinkRetry && otaLink.interval != 0)
+  {
+    SimpleBLEPeripheral_setOtaFastMode(otaLink.fast);
+  }
+}
+
+/*********************************************************************
+ * @fn      SimpleBLEPeripheral_setOtaFastMode
+ *
+ * @brief   Ask for the shortest connection interval and no slave latency
+ *          while an OTA transfer runs, or go back to the defaults. The
+ *          request goes out through the GAP Role, which also answers
+ *          later updates from the central with these values.
+ *
+ * @param   enable - TRUE for the OTA parameters, FALSE for the defaults.
+ *
+ * @return  None.
+ */
+static void SimpleBLEPeripheral_setOtaFastMode(uint8_t enable)
+{
+  uint8_t updateReq = TRUE;
+
+  if (enable)
+  {
+    Util_restartClock(&otaIdleClock, OTA_FAST_IDLE_TIMEOUT);
+  }
+  else
+  {
+    Util_stopClock(&otaIdleClock);
+  }
+
+  if (otaLink.fast == enable && !otaLinkRetry)
+  {
+    return;
+  }
+
+  otaLink.fast = enable;
+  otaLink.minInterval = enable ? OTA_FAST_CONN_INTERVAL
+                               : DEFAULT_DESIRED_MIN_CONN_INTERVAL;
+  otaLink.maxInterval = enable ? OTA_FAST_CONN_INTERVAL
+                               : DEFAULT_DESIRED_MAX_CONN_INTERVAL;
+  otaLink.slaveLatency = enable ? OTA_FAST_SLAVE_LATENCY
+                                : DEFAULT_DESIRED_SLAVE_LATENCY;
+
+  GAPRole_SetParameter(GAPROLE_MIN_CONN_INTERVAL, sizeof(uint16_t),
+                       &otaLink.minInterval);
+  GAPRole_SetParameter(GAPROLE_MAX_CONN_INTERVAL, sizeof(uint16_t),
+                       &otaLink.maxInterval);
+  GAPRole_SetParameter(GAPROLE_SLAVE_LATENCY, sizeof(uint16_t),
+                       &otaLink.slaveLatency);
+
+  // Not connected: the next connection starts from these values anyway
+  otaLinkRetry = FALSE;
+  if (otaLink.interval != 0)
+  {
+    // blePending while the GAP Role waits on an earlier update; the end
+    // of that update tries again. The next OTA ack also does while fast,
+    // and the idle clock stands in for it when going back to the defaults.
+    // bleInvalidRange means nothing needs to change.
+    if (GAPRole_SetParameter(GAPROLE_PARAM_UPDATE_REQ, sizeof(uint8_t),
+                             &updateReq) == blePending)
+    {
+      otaLinkRetry = TRUE;
+
+      if (!enable)
+      {
+        Util_restartClock(&otaIdleClock, OTA_FAST_IDLE_TIMEOUT);
+      }
+    }
+  }
+
+#ifndef FEATURE_OAD_ONCHIP
+  SimpleProfile_SetParameter(SIMPLEPROFILE_CHAR8, SIMPLEPROFILE_CHAR8_LEN,
+                             &otaLink);
+#endif //!FEATURE_OAD_ONCHIP
+}
+
 /*********************************************************************
  * @fn      SimpleBLEPeripheral_processStateChangeEvt
  *
@@ -987,9 +1192,18 @@ static void SimpleBLEPeripheral_processStateChangeEvt(gaprole_States_t newState)
       {
         linkDBInfo_t linkInfo;
         uint8_t numActive = 0;
+        uint16_t mtu = ATT_MTU_SIZE;
 
         Util_startClock(&periodicClock);
 
+        // Every connection starts at the default MTU; OTA chunks grow
+        // once the central negotiates a larger one
+        SimpleProfile_SetParameter(SIMPLEPROFILE_ATT_MTU, sizeof(uint16_t),
+                                   &mtu);
+
+        // Parameters of the new link, for the OTA link diagnostics
+        SimpleBLEPeripheral_processParamUpdateEvt();
+
         numActive = linkDB_NumActive();
 
         // Use numActive to determine the connection handle of the last
@@ -1041,6 +1255,11 @@ static void SimpleBLEPeripheral_processStateChangeEvt(gaprole_States_t newState)
       Util_stopClock(&periodicClock);
       SimpleBLEPeripheral_freeAttRsp(bleNotConnected);
 
+      // An interrupted OTA transfer must not leave the next connection
+      // at the OTA parameters
+      otaLink.interval = 0;
+      SimpleBLEPeripheral_setOtaFastMode(FALSE);
+
       Display_print0(dispHandle, 2, 0, "Disconnected");
 
       // Clear remaining lines
@@ -1050,6 +1269,9 @@ static void SimpleBLEPeripheral_processStateChangeEvt(gaprole_States_t newState)
     case GAPROLE_WAITING_AFTER_TIMEOUT:
       SimpleBLEPeripheral_freeAttRsp(bleNotConnected);
 
+      otaLink.interval = 0;
+      SimpleBLEPeripheral_setOtaFastMode(FALSE);
+
       Display_print0(dispHandle, 2, 0, "Timed Out");
 
       // Clear remaining lines
@@ -1120,6 +1342,32 @@ static void SimpleBLEPeripheral_processCharValueChangeEvt(uint8_t paramID)
       Display_print1(dispHandle, 4, 0, "Char 3: %d", (uint16_t)newValue);
       break;
 
+    case SIMPLEPROFILE_CHAR6:
+      {
+        simpleProfileOtaAck_t ack;
+
+        // Write the OTA window ack back so the profile notifies it from
+        // this task rather than from the stack's write callback
+        SimpleProfile_GetParameter(SIMPLEPROFILE_CHAR6, &ack);
+        SimpleProfile_SetParameter(SIMPLEPROFILE_CHAR6, SIMPLEPROFILE_CHAR6_LEN,
+                                   &ack);
+
+        // The transfer is alive, keep the link fast
+        if (otaLink.fast)
+        {
+          SimpleBLEPeripheral_setOtaFastMode(TRUE);
+        }
+      }
+      break;
+
+    case SIMPLEPROFILE_OTA_ACTIVE:
+      SimpleProfile_GetParameter(SIMPLEPROFILE_OTA_ACTIVE, &newValue);
+
+      // Full speed from the first chunk; ota_dl_finish() or the idle
+      // timeout bring the power saving parameters back
+      SimpleBLEPeripheral_setOtaFastMode(newValue);
+      break;
+
     default:
       // should not reach here!
       break;
@@ -1176,25 +1424,34 @@ static void SimpleBLEPeripheral_performPeriodicTask(void)
 void SimpleBLEPeripheral_processOadWriteCB(uint8_t event, uint16_t connHandle,
                                            uint8_t *pData)
 {
-  oadTargetWrite_t *oadWriteEvt = ICall_malloc( sizeof(oadTargetWrite_t) + \
-                                             sizeof(uint8_t) * OAD_PACKET_SIZE);
+  oadTargetWrite_t *oadWriteEvt;
+  uint16_t inUse;
 
-  if ( oadWriteEvt != NULL )
+  // Queue_get() on an empty queue returns the queue itself
+  if ( !Queue_empty(hOadFreeQ) )
   {
+    oadWriteEvt = Queue_get(hOadFreeQ);
+
     oadWriteEvt->event = event;
     oadWriteEvt->connHandle = connHandle;
-
-    oadWriteEvt->pData = (uint8_t *)(&oadWriteEvt->pData + 1);
     memcpy(oadWriteEvt->pData, pData, OAD_PACKET_SIZE);
 
-    Queue_put(hOadQ, (Queue_Elem *)oadWriteEvt);
+    oadWriteStats.taken++;
+    inUse = (uint16_t)(oadWriteStats.taken - oadWriteStats.freed);
+    if (inUse > oadWriteStats.maxInUse)
+    {
+      oadWriteStats.maxInUse = inUse;
+    }
+
+    Queue_put(hOadQ, &oadWriteEvt->_elem);
 
     // Post the application's semaphore.
     Semaphore_post(sem);
   }
   else
   {
-    // Fail silently.
+    // Fail silently; the OAD client retransmits the missing block.
+    oadWriteStats.dropped++;
   }
 }
 #endif //FEATURE_OAD
@@ -57,10 +57,30 @@ extern "C"
  * INCLUDES
  */
 
+/*********************************************************************
+ * TYPEDEFS
+ */
+
+#ifdef FEATURE_OAD
+// Occupancy of the OAD write buffers: in use = taken - freed. Each counter
+// has a single writer, so they can be read at any time.
+typedef struct
+{
+  uint32_t taken;    // by the OAD write callback
+  uint32_t freed;    // by the application task
+  uint32_t dropped;  // writes lost because every buffer was in use
+  uint16_t maxInUse;
+} oadWriteStats_t;
+#endif //FEATURE_OAD
+
 /*********************************************************************
 *  EXTERNAL VARIABLES
 */
 
+#ifdef FEATURE_OAD
+extern oadWriteStats_t oadWriteStats;
+#endif //FEATURE_OAD
+
 /*********************************************************************
  * CONSTANTS
  */
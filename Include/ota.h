@@ -1,11 +1,16 @@
 #ifndef OTA_H
 #define OTA_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <ti/sysbios/knl/Task.h>
 
+#ifndef OTA_FLASH_BASE
 #define OTA_FLASH_BASE 0xd000
+#endif
+#ifndef OTA_FLASH_SIZE
 #define OTA_FLASH_SIZE 0x2000
+#endif
 
 #define OTA_ACTIVE_ZONE 0
 #define OTA_INACTIVE_ZONE 1
@@ -14,10 +19,57 @@
 #define OTA_DONE_MAGIC 0x23513dce
 #define OTA_SRAM_BASE   0x20000000
 
+/*
+ * With OTA_BOOT_XIP the two zones are A/B slots: ota_startup() runs the valid
+ * zone with the highest gen in place and downloads go to the other one, so
+ * nothing is copied at boot. Images must then be linked for the zone they are
+ * written to (see linker_wrapper.sh and extract_ota.py --ota-slot).
+ * Without it, the inactive zone is copied over the active one at boot and
+ * every image is linked for OTA_ACTIVE_ZONE.
+ */
+#ifndef OTA_BOOT_XIP
+#define OTA_BOOT_XIP 0
+#endif
+#define OTA_FLASH_ROW_SIZE 256
+
 
 #define ota_entrypoint_t ti_sysbios_knl_Task_FuncPtr
+
+/*
+ * Entrypoints are offsets from OTA_FLASH_BASE, so they also tell which zone an
+ * image was linked for.
+ */
+#define OTA_ENTRYPOINT_ZONE(ep)     (((uintptr_t) (ep)) / OTA_ZONE_SIZE)
+#define OTA_ENTRYPOINT_OFFSET(ep)   (((uintptr_t) (ep)) % OTA_ZONE_SIZE)
 #define DEFINE_ENTRYPOINT(sym)  const char * __attribute__((strong))  __ota_entrypoint_##sym = "sym";
 
+/*
+ * ota_startup() runs the payload in a task of its own, which starts with the
+ * BLE stack tasks once BIOS_start() is called. DEFINE_TASK(stack_size,
+ * priority), with decimal literals, sets its stack size in bytes and its
+ * priority; extract_ota.py finds them by symbol name, like the entrypoint.
+ */
+#define DEFINE_TASK(stack, prio)  const char * __attribute__((strong))  __ota_task_##stack##_##prio = "task";
+#define OTA_PAYLOAD_STACK_SIZE  512
+#define OTA_PAYLOAD_PRIORITY    1
+
+/*
+ * Copies len payload bytes from offset to dest at boot. A load with offset
+ * OTA_LOAD_ZERO_FILL has no payload bytes and zero-fills dest instead, so
+ * zero-initialized data is neither sent nor stored.
+ *
+ * Images with more than OTA_MAX_LOADS loads keep them in a table in the
+ * payload, usually at its end: a load with dest OTA_LOAD_TABLE stands for
+ * the len struct ota_load records at offset. Tables do not nest.
+ *
+ * A load with dest OTA_LOAD_TASK copies nothing: offset is the priority and
+ * len the stack size of the payload task. It has to be in the image header,
+ * where ota_dl_init() takes it out.
+ */
+#define OTA_LOAD_ZERO_FILL 0xffff
+#define OTA_LOAD_TABLE ((uintptr_t) -1)
+#define OTA_LOAD_TASK ((uintptr_t) -2)
+
 #pragma pack(push, 1) // no padding
 struct ota_load {
     uintptr_t dest;
@@ -28,14 +80,71 @@ struct ota_load {
 
 #define OTA_MAX_LOADS 3
 
+/*
+ * Resume checkpoints of the download in progress. ota_dl_begin() programs
+ * magic and id (a CRC of the download parameters) right after erasing the
+ * zone, then a checkpoint goes in every OTA_CHECKPOINT_ROWS programmed rows.
+ * Each checkpoint is written once, so the last one that is not blank says
+ * how much of the payload is in flash and its CRC.
+ */
+#define OTA_PROGRESS_MAGIC  0x5e5d0a7a
+#define OTA_NR_CHECKPOINTS  16
+#define OTA_CHECKPOINT_ROWS \
+    ((OTA_ZONE_SIZE / OTA_FLASH_ROW_SIZE + OTA_NR_CHECKPOINTS - 1) / OTA_NR_CHECKPOINTS)
+
+struct ota_checkpoint {
+    uint32_t dl_done;
+    uint32_t crc;           /* ota_crc32() of payload[0..dl_done) */
+};
+
+struct ota_progress {
+    uint32_t magic;
+    uint32_t id;
+    struct ota_checkpoint cp[OTA_NR_CHECKPOINTS];
+};
+
+/*
+ * Boot-confirm marks, each programmed once over the erased word after the
+ * zone is committed, so they cost no erase. A committed zone starts on
+ * trial; ota_startup() marks it booted, and the payload calls ota_confirm()
+ * once it works. A zone found booted but not confirmed at the next boot, or
+ * rolled back with ota_rollback(), is revoked and no longer runs.
+ */
+#define OTA_BOOTED_MAGIC    0xb0075a7e
+#define OTA_CONFIRMED_MAGIC 0xc0af1e3d
+#define OTA_REVOKED_MAGIC   0x4e7012ed
+
+/*
+ * Committed by ota_dl_finish() in two program operations: everything before
+ * `done` as one record, then `done` itself. A zone only counts as valid once
+ * done == OTA_DONE_MAGIC, so a reset between the two leaves it invalid rather
+ * than half-described. Kept word aligned (the payload size is a multiple of 4).
+ */
 struct ota_metadata {
     unsigned long gen;
     ota_entrypoint_t entrypoint;
     size_t size;
     struct ota_load loads[OTA_MAX_LOADS];
+    uint16_t task_stack_size;   /* 0 for OTA_PAYLOAD_STACK_SIZE */
+    uint16_t task_priority;     /* 0 for OTA_PAYLOAD_PRIORITY */
+    uint32_t crc;           /* ota_crc32() of payload[0..size) */
     unsigned long done;
+    uint32_t booted;        /* OTA_BOOTED_MAGIC */
+    uint32_t confirmed;     /* OTA_CONFIRMED_MAGIC */
+    uint32_t revoked;       /* OTA_REVOKED_MAGIC */
+    struct ota_progress progress;
 };
 
+#define OTA_METADATA_RECORD_SIZE offsetof(struct ota_metadata, done)
+
+/*
+ * sizeof (struct ota_metadata) on the device, where pointers, size_t and long
+ * are 32 bits. FLASH_OTA_METADATA_LEN in TOOLS/cc26xx_app.cmd and
+ * OTA_METADATA_SIZE in ota_container.py bound images with the same number;
+ * Startup/ota.c fails to build when the struct no longer matches it.
+ */
+#define OTA_METADATA_SIZE 196
+
 #define OTA_PAYLOAD_SIZE (OTA_ZONE_SIZE - sizeof (struct ota_metadata))
 
 struct ota_zone {
@@ -49,10 +158,61 @@ struct ota_region {
 
 extern struct ota_region *OTA_REGION;
 
+/*
+ * How ota_dl_process() reads the download stream. OTA_ENC_RAW is the
+ * payload itself. OTA_ENC_DELTA rebuilds the payload out of the image in
+ * the live zone: the stream starts with the CRC32 of that image (its
+ * metadata.crc), so a delta made against any other image is refused before
+ * anything is programmed, and ops follow:
+ *
+ *   0x00..0x7f  literal, (op + 1) payload bytes follow
+ *   0x80        copy, u16 offset and u16 len (little-endian) of live
+ *               payload bytes
+ *
+ * OTA_ENC_LZ compresses the payload against itself. The zero-padded holes
+ * and placeholders extract_ota.py leaves shrink to a few bytes:
+ *
+ *   0x00..0x7f  literal, as above
+ *   0x80..0xff  match, (op & 0x7f) + 3 bytes that appeared `distance` bytes
+ *               earlier in the payload; distance - 1 follows as one byte
+ *               if below 0x80, else as two bytes, big-endian, top bit set
+ *
+ * Matches read back what is already in the zone, or still staged in
+ * row_buf, so decompressing needs no window buffer of its own.
+ *
+ * OTA_ENC_SPARSE sends runs of erased bytes (0xff, the padding extract_ota.py
+ * puts between segments) as a single op:
+ *
+ *   0x00..0x7f  literal, as above
+ *   0x80..0xff  (op & 0x7f) + 1 bytes of 0xff
+ *
+ * Whatever the encoding, ota_dl_flush() leaves out the OTA_ERASED_BLOCK
+ * aligned blocks of a row that are all 0xff, since the erase set them already.
+ *
+ * Ops produce the payload from wherever the download starts, so a resumed
+ * download gets a delta, or a compressed stream, for the rest of the image.
+ */
+#define OTA_ENC_RAW         0
+#define OTA_ENC_DELTA       1
+#define OTA_ENC_LZ          2
+#define OTA_ENC_SPARSE      3
+#define OTA_NR_ENCODINGS    4
+
+#define OTA_OP_LITERAL_MAX  0x80
+#define OTA_OP_COPY         0x80
+#define OTA_OP_MATCH_MIN    3
+#define OTA_OP_FAR          0x80
+#define OTA_LZ_DISTANCE_MAX 0x8000
+#define OTA_OP_MAX_SIZE     5
+#define OTA_ERASED_BLOCK    16
+
 struct ota_dl_params {
     size_t dl_size;
     ota_entrypoint_t entrypoint;
     struct ota_load loads[OTA_MAX_LOADS];
+    uint16_t task_stack_size;
+    uint16_t task_priority;
+    uint8_t encoding;
 };
 
 struct ota_dl_state {
@@ -63,17 +223,168 @@ struct ota_dl_state {
     ota_entrypoint_t entrypoint;
     size_t sector_size;
     size_t nr_sectors;
+    /* next payload sector (flash sector index) to erase on demand */
+    size_t next_erase;
     struct ota_load loads[OTA_MAX_LOADS];
-    /* dl_csum */
+    uint16_t task_stack_size;
+    uint16_t task_priority;
+    /* incoming bytes not yet programmed, flushed one flash row at a time */
+    uint8_t row_buf[OTA_FLASH_ROW_SIZE];
+    size_t row_len;
+    /* running CRC32 of the bytes accepted so far */
+    uint32_t crc;
+    /* if set, ota_dl_finish() refuses to commit unless crc == expected_crc */
+    uint8_t check_crc;
+    uint32_t expected_crc;
+    /* identifies the download in the zone's progress record */
+    uint32_t progress_id;
+    /* continued by ota_dl_resume(): rows past dl_done may be programmed */
+    uint8_t resumed;
+    /* OTA_ENC_* of the stream, and the op being taken apart */
+    uint8_t encoding;
+    struct ota_zone *base_zone;
+    uint8_t base_checked;
+    uint8_t op[OTA_OP_MAX_SIZE];
+    size_t op_len;
+    size_t op_left;
 };
 
+/*
+ * Flash critical-section accounting for the current download, reset by
+ * ota_dl_init(). Times are in xdc Timestamp ticks.
+ */
+struct ota_flash_stats {
+    uint32_t sessions;
+    uint32_t masked_ticks;
+    uint32_t masked_max_ticks;
+};
+
+extern struct ota_flash_stats ota_flash_stats;
+
+/* Download engine errors; positive values are FAPI_STATUS_* codes. */
+#define OTA_ERR_ZONE_MISMATCH   (-1)
+#define OTA_ERR_CRC_MISMATCH    (-2)
+#define OTA_ERR_NO_RESUME       (-3)
+#define OTA_ERR_RESUME_MISMATCH (-4)
+#define OTA_ERR_DELTA_BASE      (-5)
+#define OTA_ERR_BAD_STREAM      (-6)
+#define OTA_ERR_SWAP_TIMEOUT    (-7)
+#define OTA_ERR_SWAP_LOCKED     (-8)
+#define OTA_ERR_NO_ROLLBACK     (-9)
+
+/*
+ * Hot swap: ota_swap() starts the newest committed image without a reset,
+ * the way ota_startup() does at boot, once the running payload task has
+ * returned. It asks the payload to by making ota_payload_stopping() return
+ * nonzero, which a long-running payload polls at points where it is safe to
+ * stop; before returning it must undo whatever still points into its code
+ * (clocks, callbacks, Hwis). If the payload has not returned within
+ * OTA_SWAP_TIMEOUT_MS, ota_swap() gives up with OTA_ERR_SWAP_TIMEOUT and
+ * the old image keeps running.
+ *
+ * Without OTA_BOOT_XIP the new image has to be copied over the active zone,
+ * which stays write-protected until a reset once an image was committed to
+ * it since the last one; ota_swap() then fails with OTA_ERR_SWAP_LOCKED
+ * before stopping anything. Either way the caller falls back to a reset.
+ */
+#ifndef OTA_SWAP_TIMEOUT_MS
+#define OTA_SWAP_TIMEOUT_MS 500
+#endif
+
+/* Swaps since boot. Times are in xdc Timestamp ticks. */
+struct ota_swap_stats {
+    uint32_t swaps;
+    uint32_t timeouts;
+    uint32_t stop_ticks;    /* last swap, waiting for the payload to return */
+    uint32_t swap_ticks;    /* last swap, from the request to the new task */
+};
+
+extern struct ota_swap_stats ota_swap_stats;
+
+/*
+ * Rollback, with OTA_BOOT_XIP only: the image before the running one stays
+ * in the other zone, so going back to it is a matter of revoking the
+ * running zone, one flash word. ota_rollback() does that and leaves
+ * starting the previous image to ota_swap() or a reset; without a valid
+ * previous image it fails with OTA_ERR_NO_ROLLBACK. A zone committed since
+ * the last reset is write-protected until the next one (FAPI_STATUS_*).
+ *
+ * A new image runs on trial while the previous one is there to go back to:
+ * unless the payload calls ota_confirm() within OTA_CONFIRM_TIMEOUT_MS of
+ * starting, the device resets and boots the previous image. So does any
+ * reset before the confirm, e.g. a crash. A payload calls ota_confirm() on
+ * every start; it is a no-op once the zone is confirmed. 0 turns trials off.
+ */
+#ifndef OTA_CONFIRM_TIMEOUT_MS
+#define OTA_CONFIRM_TIMEOUT_MS 30000
+#endif
+
+/* Rollbacks since boot, and how the last one ended */
+struct ota_rollback_stats {
+    uint32_t rollbacks;
+    int last_rc;
+};
+
+extern struct ota_rollback_stats ota_rollback_stats;
+
 void ota_startup(void);
+int ota_swap(void);
+int ota_payload_stopping(void);
+int ota_rollback(void);
+int ota_confirm(void);
+int ota_on_trial(void);
+int ota_live_zone(void);
+int ota_dl_target_zone(void);
+int ota_dl_link_zone(void);
 void ota_dl_params_init(struct ota_dl_params *params);
 void ota_dl_init(struct ota_dl_state *state, struct ota_dl_params *params);
 int ota_dl_begin(struct ota_dl_state *state);
+int ota_dl_resume(struct ota_dl_state *state, size_t dl_done);
+int ota_dl_resume_point(size_t *dl_done, uint32_t *crc);
 int ota_dl_process(struct ota_dl_state *state, uint8_t *buf, size_t len);
 int ota_dl_finish(struct ota_dl_state *state);
 
+/*
+ * OTA worker task. The BLE stack's write callback must not sit through flash
+ * erases, so chunks go through a ring of OTA_WORKER_SLOTS preallocated
+ * buffers: the callback copies chunk `seq` straight from the ATT PDU into
+ * ota_worker_slot(seq), in any order, and ota_worker_post(end) hands every
+ * slot before `end` to the worker, which calls `fn` on them in order, in
+ * place. ota_worker_slot() returns NULL while the worker still holds the
+ * slot, which the caller turns into flow control. `seq` counts from 0 after
+ * boot.
+ */
+#ifndef OTA_WORKER_SLOTS
+#define OTA_WORKER_SLOTS 8          /* a power of two */
+#endif
+#ifndef OTA_WORKER_MSG_SIZE
+#define OTA_WORKER_MSG_SIZE 200
+#endif
+
+struct ota_worker_msg {
+    size_t len;
+    uint8_t buf[OTA_WORKER_MSG_SIZE];
+};
+
+/* Ring occupancy since boot; ota_worker_pending() is the current one. */
+struct ota_worker_stats {
+    uint32_t posted;        /* chunks handed to the worker */
+    uint32_t full;          /* ota_worker_slot() calls refused */
+    uint32_t max_in_use;    /* most slots held by the worker at once */
+};
+
+extern struct ota_worker_stats ota_worker_stats;
+
+typedef void (*ota_worker_fn)(uint8_t *buf, size_t len);
+
+void ota_worker_start(ota_worker_fn fn);
+struct ota_worker_msg *ota_worker_slot(unsigned seq);
+void ota_worker_post(unsigned end);
+unsigned ota_worker_pending(void);
+
+/* CRC-32 as computed by zlib.crc32(); start with crc = 0. */
+uint32_t ota_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+
 int test_ota(uint8_t* buf, size_t data_len);
 void test_json(void);
 
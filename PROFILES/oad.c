@@ -64,6 +64,7 @@
 #include "oad_target.h"
 #include "oad_constants.h"
 #include "oad.h"
+#include "oad_crc.h"
 
 /*********************************************************************
  * CONSTANTS
@@ -75,6 +76,9 @@
 #define OAD_FLASH_ERR   2
 #define OAD_BUFFER_OFL  3
 
+// Bytes read from flash per OADTarget_readFlash call during image validation
+#define OAD_CRC_READ_SIZE   128
+
 /*********************************************************************
  * MACROS
  */
@@ -306,7 +310,6 @@ static void OAD_sendStatus(uint16_t connHandle, uint8_t status);
 static uint8_t CheckImageDownloadCount(void);
 static uint8_t checkDL(void);
 static uint16_t crcCalcDL(void);
-static uint16_t crc16(uint16_t crc, uint8_t val);
 #endif  // !FEATURE_OAD_ONCHIP
 
 /*********************************************************************
@@ -875,33 +878,31 @@ static uint16_t crcCalcDL(void)
   // Read over downloaded pages
   for (page = imagePage; page <= lastPage; page++)
   {
-    uint16_t offset;
-
-    // Read over all flash words in a page, excluding the CRC section of the
-    // first page and all bytes after remainder bytes on the last page.
-    for (offset = (page == imagePage) ? HAL_FLASH_WORD_SIZE : 0;
-         offset < HAL_FLASH_PAGE_SIZE &&
-         (page < lastPage || offset < numRemBytes);
-         offset += HAL_FLASH_WORD_SIZE)
-    {
-      uint8_t buf[HAL_FLASH_WORD_SIZE];
-      uint8_t idx;
+    // Read over the page in OAD_CRC_READ_SIZE bursts, excluding the CRC
+    // section of the first page and all bytes after remainder bytes on the
+    // last page.
+    uint16_t offset = (page == imagePage) ? HAL_FLASH_WORD_SIZE : 0;
+    uint16_t end = (page < lastPage) ? HAL_FLASH_PAGE_SIZE : numRemBytes;
 
-      // Read a word from flash.
-      OADTarget_readFlash(page, offset, buf, HAL_FLASH_WORD_SIZE);
+    while (offset < end)
+    {
+      uint8_t buf[OAD_CRC_READ_SIZE];
+      uint16_t len = end - offset;
 
-      // Calculate CRC of word, byte by byte.
-      for (idx = 0; idx < HAL_FLASH_WORD_SIZE; idx++)
+      if (len > OAD_CRC_READ_SIZE)
       {
-        imageCRC = crc16(imageCRC, buf[idx]);
+        len = OAD_CRC_READ_SIZE;
       }
+
+      OADTarget_readFlash(page, offset, buf, len);
+      imageCRC = oadCrc16Update(imageCRC, buf, len);
+      offset += len;
     }
   }
 
-  // IAR note explains that poly must be run with value zero for each byte of
-  // the crc.
-  imageCRC = crc16(imageCRC, 0);
-  imageCRC = crc16(imageCRC, 0);
+  // The table-driven kernel computes the direct form, which already
+  // accounts for the two zero bytes the bitwise version had to run through
+  // the polynomial at the end.
 
   // Return the CRC calculated over the image.
   return imageCRC;
@@ -939,42 +940,6 @@ static uint8_t checkDL(void)
   return (crc[0] == crc[1]);
 }
 
-/*********************************************************************
- * @fn          crc16
- *
- * @brief       Run the CRC16 Polynomial calculation over the byte parameter.
- *
- * @param       crc - Running CRC calculated so far.
- * @param       val - Value on which to run the CRC16.
- *
- * @return      crc - Updated for the run.
- */
-static uint16_t crc16(uint16_t crc, uint8_t val)
-{
-  const uint16_t poly = 0x1021;
-  uint8_t cnt;
-
-  for (cnt = 0; cnt < 8; cnt++, val <<= 1)
-  {
-    uint8_t msb = (crc & 0x8000) ? 1 : 0;
-
-    crc <<= 1;
-
-    if (val & 0x80)
-    {
-      crc |= 0x0001;
-    }
-
-    if (msb)
-    {
-      crc ^= poly;
-    }
-  }
-
-  return crc;
-}
-
-
 /*********************************************************************
  * @fn          CheckImageDownloadCount
  *
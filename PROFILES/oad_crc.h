@@ -0,0 +1,64 @@
+/******************************************************************************
+
+ @file  oad_crc.h
+
+ @brief Table-driven CRC-16 kernel for OAD image validation.
+
+ *****************************************************************************/
+#ifndef OAD_CRC_H
+#define OAD_CRC_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*********************************************************************
+ * INCLUDES
+ */
+#include <stdint.h>
+
+/*********************************************************************
+ * EXTERNAL VARIABLES
+ */
+
+// CRC-16/CCITT (poly 0x1021, MSB first, initial value 0), one entry per
+// value of the top byte of the running CRC. Defined in oad_crc.c.
+extern const uint16_t oadCrc16Table[256];
+
+/*********************************************************************
+ * FUNCTIONS
+ */
+
+/*********************************************************************
+ * @fn          oadCrc16Update
+ *
+ * @brief       Run the CRC16 calculation over a buffer, one table lookup
+ *              per byte.
+ *
+ *              This is the direct form of crc16() in oad.c: starting from
+ *              0, the result over a buffer equals running the bitwise
+ *              crc16() over the same bytes followed by two zero bytes.
+ *
+ * @param       crc - Running CRC calculated so far (0 to start).
+ * @param       pBuf - Bytes to run the CRC over.
+ * @param       len - Number of bytes in pBuf.
+ *
+ * @return      crc - Updated for the run.
+ */
+static inline uint16_t oadCrc16Update(uint16_t crc, const uint8_t *pBuf,
+                                      uint16_t len)
+{
+  while (len--)
+  {
+    crc = (uint16_t)(crc << 8) ^ oadCrc16Table[(uint8_t)(crc >> 8) ^ *pBuf++];
+  }
+
+  return crc;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OAD_CRC_H */
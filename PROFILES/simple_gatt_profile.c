@@ -61,6 +61,8 @@
 
 #include "simple_gatt_profile.h"
 #include <driverlib/sys_ctrl.h>
+#include <xdc/runtime/Types.h>
+#include <xdc/runtime/Timestamp.h>
 #include <Include/ota.h>
 
 /*********************************************************************
@@ -71,7 +73,7 @@
  * CONSTANTS
  */
 
-#define SERVAPP_NUM_ATTR_SUPPORTED        17
+#define SERVAPP_NUM_ATTR_SUPPORTED        33
 
 /*********************************************************************
  * TYPEDEFS
@@ -82,11 +84,13 @@
  */
 
 static const uint32_t OTA_BLOB_MAGIC = 0xdabad000;
+static const uint32_t OTA_BLOB_MAGIC_V2 = 0xdabad002;
 
-#define OTA_MAX_BLOB_SIZE 400u
-#define OTA_CHUNK_MTU     80u
+/* ATT write request / command: opcode and handle precede the value */
+#define ATT_WRITE_HDR_SIZE 3u
 
 #pragma pack(push, 1) // no padding
+/* Version 1 chunk header, good for up to 255 chunks */
 struct OTABlob
 {
     uint32_t magic;
@@ -98,6 +102,18 @@ struct OTABlob
     /* uint8_t blob[0]; */
 };
 
+/* Version 2 chunk header, same fields with wider counters */
+struct OTABlobV2
+{
+    uint32_t magic;
+    uint32_t total_size;
+    uint16_t cur_chunk;
+    uint16_t num_chunks;
+    uint16_t checksum;
+    uint16_t chunk_len;
+    /* uint8_t blob[0]; */
+};
+
 struct OTAHeader {
     uint16_t entrypoint;
     uint16_t size;
@@ -106,51 +122,122 @@ struct OTAHeader {
 
 #pragma pack(pop)
 
-static int g_previous_chunk = -1;
-static unsigned g_num_bytes_rcvd;
+/* The header, a payload filling the whole zone and the CRC trailer */
+#define OTA_MAX_BLOB_SIZE \
+    (sizeof (struct OTAHeader) + OTA_PAYLOAD_SIZE + sizeof (uint32_t))
+
+/* A chunk of either header version */
+struct ota_chunk {
+    uint32_t total_size;
+    uint16_t cur_chunk;
+    uint16_t num_chunks;
+    uint16_t chunk_len;
+    uint8_t *data;
+};
 
-static int check_blob(struct OTABlob* blob, size_t len)
+/*
+ * Chunks the client may have in flight. The device acks over
+ * characteristic 6 at every window boundary and whenever it sees a gap,
+ * so the client keeps writing without waiting for responses and resends
+ * only what the ack bitmap says is missing.
+ *
+ * Every chunk is copied once, from the ATT PDU into its slot of the OTA
+ * worker ring (ota_worker_slot). Chunks that arrive ahead of a gap wait
+ * there; once the gap closes, ota_worker_post() hands the slots to the
+ * worker task, which does the flash work in ota_transaction() without
+ * another copy. The window state belongs to the stack's write callback,
+ * everything from ota_transaction() on to the worker.
+ */
+#define OTA_WINDOW       8u
+
+#if SIMPLEPROFILE_CHAR3_LEN > OTA_WORKER_MSG_SIZE
+#error "OTA_WORKER_MSG_SIZE must hold a whole characteristic 3 write"
+#endif
+#if OTA_WORKER_SLOTS < OTA_WINDOW
+#error "the OTA worker ring must hold a whole window"
+#endif
+
+static uint16_t g_next_chunk;
+static unsigned g_seq_base;     // worker ring sequence of chunk 0
+static uint8_t g_window_map;    // bit i: chunk g_next_chunk + 1 + i buffered
+static uint8_t g_window_ack;    // an ack should be notified
+static uint8_t g_window_done;   // the last chunk went to the worker
+static uint32_t g_window_size;  // total_size of the transfer, 0 until known
+static uint16_t g_window_chunks;      // num_chunks of the transfer
+static uint8_t g_transfer;      // control messages queued, one per transfer
+static uint8_t g_worker_transfer;     // control messages the worker handled
+/*
+ * Set when a transfer is dropped: by the worker when the engine refuses a
+ * chunk, by the write callback when it refuses chunk 0
+ */
+static volatile uint8_t g_ota_failed;
+static volatile uint8_t g_failed_transfer;
+static uint8_t g_ota_complete;
+static uint8_t g_ota_active;
+static uint8_t g_ota_active_changed;  // the application should be told
+static unsigned g_num_bytes_rcvd;     // worker only, see ota_transaction()
+static uint32_t g_resume_offset;  // image bytes the transfer skips
+static uint8_t g_encoding;        // OTA_ENC_* of the transfer
+static uint32_t g_data_left;      // encoded image bytes still to come
+
+/* Small chunks may split the image header */
+static uint8_t g_header_buf[sizeof (struct OTAHeader)];
+static unsigned g_header_len;
+
+/* CRC32 of the image, sent by prepare_blobs.py after the image bytes */
+static uint8_t g_crc_trailer[sizeof (uint32_t)];
+static unsigned g_crc_trailer_len;
+
+/*
+ * Decodes the header of a characteristic 3 write. Anything a peer could
+ * send that does not make a valid chunk returns -1, which the write
+ * callback answers with ATT_ERR_INVALID_VALUE.
+ */
+static int check_blob(uint8_t *buf, size_t len, struct ota_chunk *chunk)
 {
-    if (len < sizeof(struct OTABlob)) {
-        //std::cerr << "struct is too small." << std::endl;
-        while (1);
-    }
+    const struct OTABlob *blob = (const void *) buf;
+    const struct OTABlobV2 *blob2 = (const void *) buf;
+    size_t header_len;
 
-    if (blob->magic != OTA_BLOB_MAGIC) {
-        //std::cerr << "magic mismatch." << std::endl;
-        while (1);
+    if (len < sizeof(struct OTABlob)) {
+        return -1;
     }
 
-    if (blob->total_size == 0 ||
-        blob->total_size > OTA_MAX_BLOB_SIZE) {
-        //std::cerr << "blob total size is 0 or exceeded max size: "
-        //          << blob->chunk_len << std::endl;
-        while (1);
+    if (blob->magic == OTA_BLOB_MAGIC) {
+        header_len = sizeof (*blob);
+        chunk->total_size = blob->total_size;
+        chunk->cur_chunk = blob->cur_chunk;
+        chunk->num_chunks = blob->num_chunks;
+        chunk->chunk_len = blob->chunk_len;
+    } else if (blob->magic == OTA_BLOB_MAGIC_V2) {
+        if (len < sizeof(struct OTABlobV2)) {
+            return -1;
+        }
+        header_len = sizeof (*blob2);
+        chunk->total_size = blob2->total_size;
+        chunk->cur_chunk = blob2->cur_chunk;
+        chunk->num_chunks = blob2->num_chunks;
+        chunk->chunk_len = blob2->chunk_len;
+    } else {
+        return -1;
     }
+    chunk->data = buf + header_len;
 
-    if (blob->chunk_len == 0 ||
-        blob->chunk_len > OTA_CHUNK_MTU) {
-        //std::cerr << "chunk length is 0 or exceeded max size: "
-        //          << blob->chunk_len << std::endl;
-        while (1);
+    if (chunk->total_size == 0 ||
+        chunk->total_size > OTA_MAX_BLOB_SIZE) {
+        return -1;
     }
 
-    if (len < sizeof(*blob) + blob->chunk_len) {
-        //std::cerr << "invalid blob size: "
-        //          << g_num_bytes_rcvd + blob->chunk_len << std::endl;
-        while (1);
+    if (chunk->chunk_len == 0 ||
+        header_len + chunk->chunk_len > SIMPLEPROFILE_CHAR3_LEN) {
+        return -1;
     }
 
-    if ((int)blob->cur_chunk != g_previous_chunk + 1) {
-        //std::cerr << "invalid chunk number." << std::endl;
-        while (1);
+    if (len < header_len + chunk->chunk_len) {
         return -1;
     }
 
-    if (g_num_bytes_rcvd + blob->chunk_len > OTA_MAX_BLOB_SIZE) {
-        //std::cerr << "exceeding max transfer with: "
-        //          << g_num_bytes_rcvd + blob->chunk_len << std::endl;
-        while (1);
+    if (chunk->cur_chunk >= chunk->num_chunks) {
         return -1;
     }
 
@@ -194,6 +281,36 @@ CONST uint8 simpleProfilechar5UUID[ATT_BT_UUID_SIZE] =
   LO_UINT16(SIMPLEPROFILE_CHAR5_UUID), HI_UINT16(SIMPLEPROFILE_CHAR5_UUID)
 };
 
+// Characteristic 6 UUID: 0xFFF6
+CONST uint8 simpleProfilechar6UUID[ATT_BT_UUID_SIZE] =
+{ 
+  LO_UINT16(SIMPLEPROFILE_CHAR6_UUID), HI_UINT16(SIMPLEPROFILE_CHAR6_UUID)
+};
+
+// Characteristic 7 UUID: 0xFFF7
+CONST uint8 simpleProfilechar7UUID[ATT_BT_UUID_SIZE] =
+{ 
+  LO_UINT16(SIMPLEPROFILE_CHAR7_UUID), HI_UINT16(SIMPLEPROFILE_CHAR7_UUID)
+};
+
+// Characteristic 8 UUID: 0xFFF8
+CONST uint8 simpleProfilechar8UUID[ATT_BT_UUID_SIZE] =
+{ 
+  LO_UINT16(SIMPLEPROFILE_CHAR8_UUID), HI_UINT16(SIMPLEPROFILE_CHAR8_UUID)
+};
+
+// Characteristic 9 UUID: 0xFFF9
+CONST uint8 simpleProfilechar9UUID[ATT_BT_UUID_SIZE] =
+{ 
+  LO_UINT16(SIMPLEPROFILE_CHAR9_UUID), HI_UINT16(SIMPLEPROFILE_CHAR9_UUID)
+};
+
+// Characteristic 10 UUID: 0xFFFA
+CONST uint8 simpleProfilechar10UUID[ATT_BT_UUID_SIZE] =
+{ 
+  LO_UINT16(SIMPLEPROFILE_CHAR10_UUID), HI_UINT16(SIMPLEPROFILE_CHAR10_UUID)
+};
+
 
 
 /*********************************************************************
@@ -239,7 +356,7 @@ static uint8 simpleProfileChar2UserDesp[17] = "Characteristic 2";
 
 
 // Simple Profile Characteristic 3 Properties
-static uint8 simpleProfileChar3Props = GATT_PROP_WRITE;
+static uint8 simpleProfileChar3Props = GATT_PROP_WRITE | GATT_PROP_WRITE_NO_RSP;
 
 // Characteristic 3 Value
 static uint8 simpleProfileChar3[SIMPLEPROFILE_CHAR3_LEN] = { 0, };
@@ -281,6 +398,60 @@ static uint8 simpleProfileChar5[SIMPLEPROFILE_CHAR5_LEN] = { 0, 0, 0, 0, 0 };
 // Simple Profile Characteristic 5 User Description
 static uint8 simpleProfileChar5UserDesp[17] = "Characteristic 5";
 
+
+// Simple Profile Characteristic 6 Properties
+static uint8 simpleProfileChar6Props = GATT_PROP_READ | GATT_PROP_NOTIFY;
+
+// Characteristic 6 Value
+static simpleProfileOtaAck_t simpleProfileChar6 = { 0, 0, SIMPLEPROFILE_OTA_ACK_BUSY };
+
+// Simple Profile Characteristic 6 Configuration
+static gattCharCfg_t *simpleProfileChar6Config;
+
+// Simple Profile Characteristic 6 User Description
+static uint8 simpleProfileChar6UserDesp[8] = "OTA ack";
+
+
+// Simple Profile Characteristic 7 Properties
+static uint8 simpleProfileChar7Props = GATT_PROP_READ;
+
+// Characteristic 7 Value, maxChunk is filled in by ota_update_caps()
+static simpleProfileOtaCaps_t simpleProfileChar7 = { 0, OTA_WINDOW, 2 };
+
+// Simple Profile Characteristic 7 User Description
+static uint8 simpleProfileChar7UserDesp[9] = "OTA caps";
+
+
+// Simple Profile Characteristic 8 Properties
+static uint8 simpleProfileChar8Props = GATT_PROP_READ;
+
+// Characteristic 8 Value, kept up to date by the application
+static simpleProfileOtaLink_t simpleProfileChar8 = { 0, };
+
+// Simple Profile Characteristic 8 User Description
+static uint8 simpleProfileChar8UserDesp[9] = "OTA link";
+
+
+// Simple Profile Characteristic 9 Properties
+static uint8 simpleProfileChar9Props = GATT_PROP_READ | GATT_PROP_WRITE;
+
+// Characteristic 9 Value, filled in from flash on every read
+static simpleProfileOtaResume_t simpleProfileChar9 = { 0, };
+
+// Simple Profile Characteristic 9 User Description
+static uint8 simpleProfileChar9UserDesp[11] = "OTA resume";
+
+
+// Simple Profile Characteristic 10 Properties
+static uint8 simpleProfileChar10Props = GATT_PROP_READ | GATT_PROP_WRITE;
+
+// Characteristic 10 Value, filled in from ota_swap_stats and
+// ota_rollback_stats on every read
+static simpleProfileOtaSwap_t simpleProfileChar10 = { 0, };
+
+// Simple Profile Characteristic 10 User Description
+static uint8 simpleProfileChar10UserDesp[9] = "OTA swap";
+
 /*********************************************************************
  * Profile Attributes - Table
  */
@@ -423,6 +594,134 @@ static gattAttribute_t simpleProfileAttrTbl[SERVAPP_NUM_ATTR_SUPPORTED] =
         0, 
         simpleProfileChar5UserDesp 
       },
+
+    // Characteristic 6 Declaration
+    { 
+      { ATT_BT_UUID_SIZE, characterUUID },
+      GATT_PERMIT_READ, 
+      0,
+      &simpleProfileChar6Props 
+    },
+
+      // Characteristic Value 6
+      { 
+        { ATT_BT_UUID_SIZE, simpleProfilechar6UUID },
+        GATT_PERMIT_READ, 
+        0, 
+        (uint8 *)&simpleProfileChar6 
+      },
+
+      // Characteristic 6 configuration
+      { 
+        { ATT_BT_UUID_SIZE, clientCharCfgUUID },
+        GATT_PERMIT_READ | GATT_PERMIT_WRITE, 
+        0, 
+        (uint8 *)&simpleProfileChar6Config 
+      },
+
+      // Characteristic 6 User Description
+      { 
+        { ATT_BT_UUID_SIZE, charUserDescUUID },
+        GATT_PERMIT_READ, 
+        0, 
+        simpleProfileChar6UserDesp 
+      },
+
+    // Characteristic 7 Declaration
+    { 
+      { ATT_BT_UUID_SIZE, characterUUID },
+      GATT_PERMIT_READ, 
+      0,
+      &simpleProfileChar7Props 
+    },
+
+      // Characteristic Value 7
+      { 
+        { ATT_BT_UUID_SIZE, simpleProfilechar7UUID },
+        GATT_PERMIT_READ, 
+        0, 
+        (uint8 *)&simpleProfileChar7 
+      },
+
+      // Characteristic 7 User Description
+      { 
+        { ATT_BT_UUID_SIZE, charUserDescUUID },
+        GATT_PERMIT_READ, 
+        0, 
+        simpleProfileChar7UserDesp 
+      },
+
+    // Characteristic 8 Declaration
+    { 
+      { ATT_BT_UUID_SIZE, characterUUID },
+      GATT_PERMIT_READ, 
+      0,
+      &simpleProfileChar8Props 
+    },
+
+      // Characteristic Value 8
+      { 
+        { ATT_BT_UUID_SIZE, simpleProfilechar8UUID },
+        GATT_PERMIT_READ, 
+        0, 
+        (uint8 *)&simpleProfileChar8 
+      },
+
+      // Characteristic 8 User Description
+      { 
+        { ATT_BT_UUID_SIZE, charUserDescUUID },
+        GATT_PERMIT_READ, 
+        0, 
+        simpleProfileChar8UserDesp 
+      },
+
+    // Characteristic 9 Declaration
+    { 
+      { ATT_BT_UUID_SIZE, characterUUID },
+      GATT_PERMIT_READ, 
+      0,
+      &simpleProfileChar9Props 
+    },
+
+      // Characteristic Value 9
+      { 
+        { ATT_BT_UUID_SIZE, simpleProfilechar9UUID },
+        GATT_PERMIT_READ | GATT_PERMIT_WRITE, 
+        0, 
+        (uint8 *)&simpleProfileChar9 
+      },
+
+      // Characteristic 9 User Description
+      { 
+        { ATT_BT_UUID_SIZE, charUserDescUUID },
+        GATT_PERMIT_READ, 
+        0, 
+        simpleProfileChar9UserDesp 
+      },
+
+    // Characteristic 10 Declaration
+    { 
+      { ATT_BT_UUID_SIZE, characterUUID },
+      GATT_PERMIT_READ, 
+      0,
+      &simpleProfileChar10Props 
+    },
+
+      // Characteristic Value 10
+      { 
+        { ATT_BT_UUID_SIZE, simpleProfilechar10UUID },
+        GATT_PERMIT_READ | GATT_PERMIT_WRITE, 
+        0, 
+        (uint8 *)&simpleProfileChar10 
+      },
+
+      // Characteristic 10 User Description
+      { 
+        { ATT_BT_UUID_SIZE, charUserDescUUID },
+        GATT_PERMIT_READ, 
+        0, 
+        simpleProfileChar10UserDesp 
+      },
 };
 
 #define _OTA_STATE_NEW  0
@@ -431,57 +730,463 @@ static int _ota_state = _OTA_STATE_NEW;
 static struct ota_dl_params ota_params;
 static struct ota_dl_state ota_state;
 
-static int ota_transaction(struct OTABlob* blob, size_t len)
+static int ota_transaction(const struct ota_chunk *chunk)
 {
-    if (check_blob(blob, len)) {
+    size_t len = chunk->chunk_len;
+    uint8_t *data = chunk->data;
+    const struct OTAHeader *header;
+    size_t n;
+
+    // Chunks reach the worker in order, so this is the image so far
+    if (g_num_bytes_rcvd + chunk->chunk_len > chunk->total_size) {
         return -1;
     }
-    len -= sizeof (struct OTABlob);
-
-    uint8_t *data = (void *) blob;
-    data = data + sizeof (struct OTABlob);
-    struct OTAHeader *header;
 
     switch (_ota_state) {
     case _OTA_STATE_NEW:
-        header = (struct OTAHeader *) data;
+        n = sizeof (g_header_buf) - g_header_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(&g_header_buf[g_header_len], data, n);
+        g_header_len += n;
+        len -= n;
+        data += n;
+        if (g_header_len < sizeof (g_header_buf)) {
+            if (chunk->cur_chunk + 1 == chunk->num_chunks) {
+                return -1;
+            }
+            break;
+        }
+        g_header_len = 0;
+
+        header = (const struct OTAHeader *) g_header_buf;
         ota_dl_params_init(&ota_params);
         ota_params.entrypoint = (ota_entrypoint_t) header->entrypoint;
         ota_params.dl_size = header->size;
+        ota_params.encoding = g_encoding;
         for (int i = 0; i < OTA_MAX_LOADS; i++) {
             ota_params.loads[i].offset = header->loads[i].offset;
             ota_params.loads[i].len = header->loads[i].len;
             ota_params.loads[i].dest = header->loads[i].dest;
         }
         ota_dl_init(&ota_state, &ota_params);
-        ota_dl_begin(&ota_state);
-        len -= sizeof (struct OTAHeader);
-        data = data + sizeof (struct OTAHeader);
+        if (g_resume_offset) {
+            // The sender skipped what the last checkpoint has in flash
+            if (ota_dl_resume(&ota_state, g_resume_offset)) {
+                return -1;
+            }
+        } else if (ota_dl_begin(&ota_state)) {
+            // e.g. an image linked for the zone we are running from
+            return -1;
+        }
+        if (g_encoding != OTA_ENC_RAW) {
+            // Encoded streams always end in the CRC trailer
+            if (chunk->total_size < sizeof (struct OTAHeader) + sizeof (g_crc_trailer)) {
+                return -1;
+            }
+            g_data_left = chunk->total_size - sizeof (struct OTAHeader)
+                                            - sizeof (g_crc_trailer);
+        }
         _ota_state = _OTA_STATE_DATA;
+        g_ota_active = 1;
+        g_ota_active_changed = 1;
     case _OTA_STATE_DATA:
+        // Encoded, the image is whatever comes before the trailer
+        if (ota_state.encoding == OTA_ENC_RAW) {
+            n = ota_state.dl_size - ota_state.dl_done;
+        } else {
+            n = g_data_left;
+        }
+        if (n > len) {
+            n = len;
+        }
+        if (n && ota_dl_process(&ota_state, data, n)) {
+            return -1;
+        }
+        len -= n;
+        data += n;
+        if (ota_state.encoding != OTA_ENC_RAW) {
+            g_data_left -= n;
+        }
+
         if (len) {
-            ota_dl_process(&ota_state, data, len);
+            if (g_crc_trailer_len + len > sizeof (g_crc_trailer)) {
+                return -1;
+            }
+            memcpy(&g_crc_trailer[g_crc_trailer_len], data, len);
+            g_crc_trailer_len += len;
         }
-        if (ota_state.dl_done == ota_state.dl_size) {
-            ota_dl_finish(&ota_state);
+
+        if (chunk->cur_chunk + 1 == chunk->num_chunks) {
+            // Senders without a trailer get no integrity check
+            if (g_crc_trailer_len == sizeof (g_crc_trailer)) {
+                memcpy(&ota_state.expected_crc, g_crc_trailer,
+                       sizeof (g_crc_trailer));
+                ota_state.check_crc = 1;
+            }
+            g_crc_trailer_len = 0;
+            if (ota_dl_finish(&ota_state)) {
+                return -1;
+            }
         }
         break;
     }
 
-    g_previous_chunk++;
-    g_num_bytes_rcvd += blob->chunk_len;
+    g_num_bytes_rcvd += chunk->chunk_len;
 
-    if (blob->cur_chunk + 1 == blob->num_chunks) {
-        //std::cout << "done, received: " << g_num_bytes_rcvd
-        //          << " bytes." << std::endl;
-        g_previous_chunk = -1;
+    if (chunk->cur_chunk + 1 == chunk->num_chunks) {
         g_num_bytes_rcvd = 0;
-        // TODO: add crc check
+        g_ota_complete = 1;
+        g_ota_active = 0;
+        g_ota_active_changed = 1;
     }
 
     return 0;
 }
 
+static void ota_update_caps(uint16_t mtu)
+{
+    uint16_t max = mtu - ATT_WRITE_HDR_SIZE;
+
+    if (max > SIMPLEPROFILE_CHAR3_LEN) {
+        max = SIMPLEPROFILE_CHAR3_LEN;
+    }
+    simpleProfileChar7.maxChunk = max - sizeof (struct OTABlobV2);
+}
+
+/*
+ * Whether the worker dropped a transfer. Both sides count the control
+ * messages that start transfers, so a failure the worker reports late,
+ * for chunks queued before a restart, does not hit the new transfer.
+ */
+static int ota_transfer_failed(uint8_t transfer)
+{
+    return g_ota_failed && g_failed_transfer == transfer;
+}
+
+static void ota_window_update_ack(void)
+{
+    simpleProfileChar6.base = g_next_chunk;
+    simpleProfileChar6.bitmap = g_window_map;
+    if (ota_transfer_failed(g_transfer)) {
+        simpleProfileChar6.status = SIMPLEPROFILE_OTA_ACK_ERROR;
+    } else {
+        simpleProfileChar6.status = g_window_done ? SIMPLEPROFILE_OTA_ACK_DONE
+                                                  : SIMPLEPROFILE_OTA_ACK_BUSY;
+    }
+}
+
+static void ota_resume_point(simpleProfileOtaResume_t *rp)
+{
+    size_t offset;
+    uint32_t crc;
+
+    if (ota_dl_resume_point(&offset, &crc)) {
+        offset = 0;
+        crc = 0;
+    }
+    rp->offset = offset;
+    rp->crc = crc;
+    rp->encoding = OTA_ENC_RAW;
+}
+
+static void ota_swap_info(simpleProfileOtaSwap_t *info)
+{
+    Types_FreqHz freq;
+    uint32_t per_us;
+
+    Timestamp_getFreq(&freq);
+    per_us = freq.lo / 1000000;
+    if (per_us == 0) {
+        per_us = 1;
+    }
+    info->swaps = ota_swap_stats.swaps;
+    info->swapUs = ota_swap_stats.swap_ticks / per_us;
+    info->stopUs = ota_swap_stats.stop_ticks / per_us;
+    info->rollbacks = ota_rollback_stats.rollbacks;
+    info->rollbackRc = ota_rollback_stats.last_rc;
+    info->trial = ota_on_trial();
+}
+
+/*
+ * Zero-length worker messages carry a control byte instead of a chunk,
+ * followed by its argument
+ */
+#define OTA_CTRL_RESTART  0     // simpleProfileOtaResume_t
+#define OTA_CTRL_ROLLBACK 1     // none
+
+/* OTA_CTRL_RESTART: the next chunk 0 starts a new transfer */
+static void ota_transaction_restart(const uint8_t *buf)
+{
+    simpleProfileOtaResume_t rp;
+
+    memcpy(&rp, buf, sizeof (rp));
+    g_resume_offset = rp.offset;
+    g_encoding = rp.encoding;
+    _ota_state = _OTA_STATE_NEW;
+    g_header_len = 0;
+    g_crc_trailer_len = 0;
+    g_num_bytes_rcvd = 0;
+    if (g_ota_active) {
+        g_ota_active = 0;
+        g_ota_active_changed = 1;
+    }
+}
+
+/*
+ * The engine refused a chunk: a bad header, a corrupt image, one linked
+ * for the wrong zone and the like. What the ring still holds of the
+ * transfer is dropped, and the ack tells the sender to start over.
+ */
+static void ota_transaction_fail(void)
+{
+    simpleProfileOtaResume_t rp = { 0, };
+
+    ota_transaction_restart((const uint8_t *) &rp);
+    g_failed_transfer = g_worker_transfer;
+    g_ota_failed = 1;
+
+    // The sender may be past its last window and only waiting
+    simpleProfileChar6.status = SIMPLEPROFILE_OTA_ACK_ERROR;
+    if ( simpleProfile_AppCBs && simpleProfile_AppCBs->pfnSimpleProfileChange )
+    {
+        simpleProfile_AppCBs->pfnSimpleProfileChange( SIMPLEPROFILE_CHAR6 );
+    }
+}
+
+/*
+ * OTA_CTRL_ROLLBACK: back to the image that ran before the current one,
+ * dropping whatever transfer was under way
+ */
+static void ota_transaction_rollback(void)
+{
+    simpleProfileOtaResume_t rp = { 0, };
+
+    ota_transaction_restart((const uint8_t *) &rp);
+    if (ota_rollback() == 0 && ota_swap()) {
+        SysCtrlSystemReset();
+    }
+}
+
+/* Runs in the OTA worker task, one queued chunk at a time */
+static void ota_worker_chunk(uint8_t *buf, size_t len)
+{
+    struct ota_chunk chunk;
+
+    if (len == 0) {
+        g_worker_transfer++;
+        if (buf[0] == OTA_CTRL_ROLLBACK) {
+            ota_transaction_rollback();
+        } else {
+            ota_transaction_restart(buf + 1);
+        }
+    } else if (ota_transfer_failed(g_worker_transfer)) {
+        // The rest of a dropped transfer, up to the next control message
+    } else if (check_blob(buf, len, &chunk) || ota_transaction(&chunk)) {
+        ota_transaction_fail();
+    }
+
+    // A transfer started or ended: the application changes the
+    // connection parameters
+    if (g_ota_active_changed) {
+        g_ota_active_changed = 0;
+        if ( simpleProfile_AppCBs && simpleProfile_AppCBs->pfnSimpleProfileChange )
+        {
+            simpleProfile_AppCBs->pfnSimpleProfileChange( SIMPLEPROFILE_OTA_ACTIVE );
+        }
+    }
+
+    /* we finished copying the entire blob: run it, or reboot into it */
+    if (g_ota_complete) {
+        g_ota_complete = 0;
+        if (ota_swap()) {
+            SysCtrlSystemReset();
+        }
+    }
+}
+
+/*
+ * Queues a control message for the worker behind whatever it still holds
+ * of the current transfer; the chunks that follow start a new one.
+ */
+static int ota_window_control(uint8_t ctrl, const void *arg, size_t len)
+{
+    struct ota_worker_msg *msg;
+    unsigned seq = g_seq_base + g_next_chunk;
+
+    msg = ota_worker_slot(seq);
+    if (msg == NULL) {
+        return ATT_ERR_INSUFFICIENT_RESOURCES;
+    }
+    msg->len = 0;
+    msg->buf[0] = ctrl;
+    if (len) {
+        memcpy(&msg->buf[1], arg, len);
+    }
+
+    g_seq_base = seq + 1;
+    ota_worker_post(g_seq_base);
+
+    g_transfer++;
+    g_ota_failed = 0;
+    g_next_chunk = 0;
+    g_window_map = 0;
+    g_window_done = 0;
+    g_window_ack = 0;
+    g_window_size = 0;
+    return SUCCESS;
+}
+
+/*
+ * Chunk 0 starts with the image header. An image linked for another zone
+ * is refused before any of it reaches the worker.
+ */
+static int ota_window_check_zone(const struct ota_chunk *chunk)
+{
+    uint16_t entrypoint;
+
+    // Tiny chunks: the worker checks it once the header is whole
+    if (chunk->chunk_len < sizeof (entrypoint)) {
+        return SUCCESS;
+    }
+    memcpy(&entrypoint, chunk->data, sizeof (entrypoint));
+    if (OTA_ENTRYPOINT_ZONE(entrypoint) != ota_dl_link_zone()) {
+        return ATT_ERR_INVALID_VALUE;
+    }
+    return SUCCESS;
+}
+
+/*
+ * A write to characteristic 3. Returns an ATT error for a chunk that is
+ * refused; the ack tells write commands the same.
+ */
+static int ota_window_receive(uint8_t *buf, size_t len)
+{
+    struct ota_chunk chunk;
+    struct ota_worker_msg *msg;
+    simpleProfileOtaResume_t rp = { 0, };
+    uint16_t idx;
+    int status;
+
+    if (check_blob(buf, len, &chunk)) {
+        return ATT_ERR_INVALID_VALUE;
+    }
+    if (g_window_done || ota_transfer_failed(g_transfer)) {
+        // The transfer is over: everything is queued and the device swaps
+        // once it is committed, or it was dropped. Its chunks keep getting
+        // the ack that says so; chunk 0 starts a new transfer from scratch,
+        // behind the old one in the ring.
+        if (chunk.cur_chunk != 0 ||
+            ota_window_control(OTA_CTRL_RESTART, &rp, sizeof (rp))) {
+            g_window_ack = 1;
+            return 0;
+        }
+    }
+    // anything past chunk_len is padding from the transport
+    len = (chunk.data - buf) + chunk.chunk_len;
+    idx = chunk.cur_chunk;
+
+    if (idx < g_next_chunk || idx >= g_next_chunk + OTA_WINDOW) {
+        // A resend of something we already have, or the client ran past
+        // the window. Drop it and tell the client where we are.
+        g_window_ack = 1;
+        return 0;
+    }
+
+    // Every chunk before this one is at least as long as it is; the
+    // worker checks the exact byte count once the chunk is its turn.
+    // The byte count itself is the worker's and may be windows behind.
+    if ((uint32_t) idx * chunk.chunk_len >= chunk.total_size) {
+        return ATT_ERR_INVALID_VALUE;
+    }
+    if (g_window_size == 0) {
+        g_window_size = chunk.total_size;
+        g_window_chunks = chunk.num_chunks;
+    } else if (chunk.total_size != g_window_size ||
+               chunk.num_chunks != g_window_chunks) {
+        return ATT_ERR_INVALID_VALUE;
+    }
+
+    if (idx == 0) {
+        status = ota_window_check_zone(&chunk);
+        if (status != SUCCESS) {
+            // Nothing of the transfer went to the worker yet
+            g_window_map = 0;
+            g_failed_transfer = g_transfer;
+            g_ota_failed = 1;
+            g_window_ack = 1;
+            return status;
+        }
+    }
+
+    // The worker still holds the slot from a window ago: drop the chunk
+    // and let the ack tell the client to send it again
+    msg = ota_worker_slot(g_seq_base + idx);
+    if (msg == NULL) {
+        g_window_ack = 1;
+        return 0;
+    }
+    memcpy(msg->buf, buf, len);
+    msg->len = len;
+
+    if (idx != g_next_chunk) {
+        g_window_map |= 1u << (idx - g_next_chunk - 1);
+        // a gap: let the client resend it before the window drains
+        g_window_ack = 1;
+        return 0;
+    }
+
+    // Take in every buffered chunk this one unblocks. After the increment
+    // bit 0 of g_window_map refers to g_next_chunk itself.
+    g_next_chunk++;
+    while (g_window_map & 1) {
+        g_window_map >>= 1;
+        g_next_chunk++;
+    }
+    g_window_map >>= 1;
+    ota_worker_post(g_seq_base + g_next_chunk);
+
+    if (g_next_chunk == g_window_chunks) {
+        g_window_done = 1;
+        g_window_ack = 1;
+    }
+    if (g_next_chunk % OTA_WINDOW == 0) {
+        g_window_ack = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * A write to characteristic 9: the chunks that follow are a new transfer,
+ * e.g. after the connection dropped half way.
+ */
+static int ota_window_restart(const simpleProfileOtaResume_t *rp)
+{
+    simpleProfileOtaResume_t cur;
+
+    // Only the checkpoint in flash can be continued
+    ota_resume_point(&cur);
+    if (rp->offset && (rp->offset != cur.offset || rp->crc != cur.crc)) {
+        return ATT_ERR_INVALID_VALUE;
+    }
+    if (rp->encoding >= OTA_NR_ENCODINGS) {
+        return ATT_ERR_INVALID_VALUE;
+    }
+    return ota_window_control(OTA_CTRL_RESTART, rp, sizeof (*rp));
+}
+
+/*
+ * A write of SIMPLEPROFILE_OTA_SWAP_ROLLBACK to characteristic 10: the
+ * worker revokes the running image and swaps to the one before it, as it
+ * does after a download. Whether that worked shows in the next read.
+ */
+static int ota_window_rollback(void)
+{
+    return ota_window_control(OTA_CTRL_ROLLBACK, NULL, 0);
+}
+
 
 /*********************************************************************
  * LOCAL FUNCTIONS
@@ -542,8 +1247,23 @@ bStatus_t SimpleProfile_AddService( uint32 services )
     return ( bleMemAllocError );
   }
   
+  simpleProfileChar6Config = (gattCharCfg_t *)ICall_malloc( sizeof(gattCharCfg_t) *
+                                                            linkDBNumConns );
+  if ( simpleProfileChar6Config == NULL )
+  {
+    ICall_free( simpleProfileChar4Config );
+    return ( bleMemAllocError );
+  }
+
   // Initialize Client Characteristic Configuration attributes
   GATTServApp_InitCharCfg( INVALID_CONNHANDLE, simpleProfileChar4Config );
+  GATTServApp_InitCharCfg( INVALID_CONNHANDLE, simpleProfileChar6Config );
+
+  // Chunks fit the default MTU until a larger one is negotiated
+  ota_update_caps( ATT_MTU_SIZE );
+
+  // Flash work for OTA chunks happens outside the stack's callbacks
+  ota_worker_start( ota_worker_chunk );
   
   if ( services & SIMPLEPROFILE_SERVICE )
   {
@@ -663,6 +1383,44 @@ bStatus_t SimpleProfile_SetParameter( uint8 param, uint8 len, void *value )
         ret = bleInvalidRange;
       }
       break;
+
+    case SIMPLEPROFILE_CHAR6:
+      if ( len == SIMPLEPROFILE_CHAR6_LEN )
+      {
+        VOID memcpy( &simpleProfileChar6, value, SIMPLEPROFILE_CHAR6_LEN );
+
+        // See if Notification has been enabled
+        GATTServApp_ProcessCharCfg( simpleProfileChar6Config, (uint8 *)&simpleProfileChar6, FALSE,
+                                    simpleProfileAttrTbl, GATT_NUM_ATTRS( simpleProfileAttrTbl ),
+                                    INVALID_TASK_ID, simpleProfile_ReadAttrCB );
+      }
+      else
+      {
+        ret = bleInvalidRange;
+      }
+      break;
+
+    case SIMPLEPROFILE_ATT_MTU:
+      if ( len == sizeof ( uint16 ) )
+      {
+        ota_update_caps( *((uint16*)value) );
+      }
+      else
+      {
+        ret = bleInvalidRange;
+      }
+      break;
+
+    case SIMPLEPROFILE_CHAR8:
+      if ( len == SIMPLEPROFILE_CHAR8_LEN )
+      {
+        VOID memcpy( &simpleProfileChar8, value, SIMPLEPROFILE_CHAR8_LEN );
+      }
+      else
+      {
+        ret = bleInvalidRange;
+      }
+      break;
       
     default:
       ret = INVALIDPARAMETER;
@@ -709,6 +1467,30 @@ bStatus_t SimpleProfile_GetParameter( uint8 param, void *value )
     case SIMPLEPROFILE_CHAR5:
       VOID memcpy( value, simpleProfileChar5, SIMPLEPROFILE_CHAR5_LEN );
       break;      
+
+    case SIMPLEPROFILE_CHAR6:
+      VOID memcpy( value, &simpleProfileChar6, SIMPLEPROFILE_CHAR6_LEN );
+      break;
+
+    case SIMPLEPROFILE_CHAR7:
+      VOID memcpy( value, &simpleProfileChar7, SIMPLEPROFILE_CHAR7_LEN );
+      break;
+
+    case SIMPLEPROFILE_CHAR8:
+      VOID memcpy( value, &simpleProfileChar8, SIMPLEPROFILE_CHAR8_LEN );
+      break;
+
+    case SIMPLEPROFILE_OTA_ACTIVE:
+      *((uint8*)value) = g_ota_active;
+      break;
+
+    case SIMPLEPROFILE_CHAR9:
+      ota_resume_point( (simpleProfileOtaResume_t *)value );
+      break;
+
+    case SIMPLEPROFILE_CHAR10:
+      ota_swap_info( (simpleProfileOtaSwap_t *)value );
+      break;
       
     default:
       ret = INVALIDPARAMETER;
@@ -772,6 +1554,33 @@ static bStatus_t simpleProfile_ReadAttrCB(uint16_t connHandle,
         *pLen = SIMPLEPROFILE_CHAR5_LEN;
         VOID memcpy( pValue, pAttr->pValue, SIMPLEPROFILE_CHAR5_LEN );
         break;
+
+      case SIMPLEPROFILE_CHAR6_UUID:
+        *pLen = SIMPLEPROFILE_CHAR6_LEN;
+        VOID memcpy( pValue, pAttr->pValue, SIMPLEPROFILE_CHAR6_LEN );
+        break;
+
+      case SIMPLEPROFILE_CHAR7_UUID:
+        *pLen = SIMPLEPROFILE_CHAR7_LEN;
+        VOID memcpy( pValue, pAttr->pValue, SIMPLEPROFILE_CHAR7_LEN );
+        break;
+
+      case SIMPLEPROFILE_CHAR8_UUID:
+        *pLen = SIMPLEPROFILE_CHAR8_LEN;
+        VOID memcpy( pValue, pAttr->pValue, SIMPLEPROFILE_CHAR8_LEN );
+        break;
+
+      case SIMPLEPROFILE_CHAR9_UUID:
+        ota_resume_point( &simpleProfileChar9 );
+        *pLen = SIMPLEPROFILE_CHAR9_LEN;
+        VOID memcpy( pValue, pAttr->pValue, SIMPLEPROFILE_CHAR9_LEN );
+        break;
+
+      case SIMPLEPROFILE_CHAR10_UUID:
+        ota_swap_info( &simpleProfileChar10 );
+        *pLen = SIMPLEPROFILE_CHAR10_LEN;
+        VOID memcpy( pValue, pAttr->pValue, SIMPLEPROFILE_CHAR10_LEN );
+        break;
         
       case SIMPLEPROFILE_CHAR3_UUID:
         *pLen = simpleProfileChar3ActualSize;
@@ -860,20 +1669,61 @@ static bStatus_t simpleProfile_WriteAttrCB(uint16_t connHandle,
 
       case SIMPLEPROFILE_CHAR3_UUID:
         //Validate the value
-        if ( offset != 0 || len > SIMPLEPROFILE_CHAR3_LEN ||
-             ota_transaction((struct OTABlob*)pValue, len) )
+        if ( offset != 0 || len > SIMPLEPROFILE_CHAR3_LEN )
         {
-            status = ATT_ERR_INVALID_VALUE_SIZE;
-            while (1);
+          status = ATT_ERR_INVALID_VALUE_SIZE;
         }
+        else
+        {
+          // The chunk is queued for the OTA worker; flash programming and
+          // the swap after the last chunk happen there.
+          status = ota_window_receive( pValue, len );
+        }
+
+        // Notifications go out from the application task, which hands
+        // the ack back through SimpleProfile_SetParameter. A refused chunk
+        // is acked too: write commands get no ATT error.
+        if (g_window_ack) {
+          g_window_ack = 0;
+          ota_window_update_ack();
+          notifyApp = SIMPLEPROFILE_CHAR6;
+        }
+        break;
 
-        //Write the value
-        if ( status == SUCCESS )
+      case SIMPLEPROFILE_CHAR9_UUID:
+        //Validate the value
+        if ( offset != 0 )
         {
-          /* we finished copying the entire blob */
-          if (g_previous_chunk == -1) {
-             SysCtrlSystemReset();
-          }
+          status = ATT_ERR_ATTR_NOT_LONG;
+        }
+        else if ( len != SIMPLEPROFILE_CHAR9_LEN )
+        {
+          status = ATT_ERR_INVALID_VALUE_SIZE;
+        }
+        else
+        {
+          // Busy worker: the client writes it again once the ring drains
+          status = ota_window_restart( (simpleProfileOtaResume_t *)pValue );
+        }
+        break;
+
+      case SIMPLEPROFILE_CHAR10_UUID:
+        //Validate the value
+        if ( offset != 0 )
+        {
+          status = ATT_ERR_ATTR_NOT_LONG;
+        }
+        else if ( len != 1 )
+        {
+          status = ATT_ERR_INVALID_VALUE_SIZE;
+        }
+        else if ( pValue[0] != SIMPLEPROFILE_OTA_SWAP_ROLLBACK )
+        {
+          status = ATT_ERR_INVALID_VALUE;
+        }
+        else
+        {
+          status = ota_window_rollback();
         }
         break;
 
@@ -67,6 +67,13 @@ extern "C"
 #define SIMPLEPROFILE_CHAR3                   2  // RW uint8 - Profile Characteristic 3 value
 #define SIMPLEPROFILE_CHAR4                   3  // RW uint8 - Profile Characteristic 4 value
 #define SIMPLEPROFILE_CHAR5                   4  // RW uint8 - Profile Characteristic 4 value
+#define SIMPLEPROFILE_CHAR6                   5  // R simpleProfileOtaAck_t - OTA window ack
+#define SIMPLEPROFILE_CHAR7                   6  // R simpleProfileOtaCaps_t - OTA capabilities
+#define SIMPLEPROFILE_ATT_MTU                 7  // W uint16 - negotiated ATT MTU, sizes characteristic 7
+#define SIMPLEPROFILE_CHAR8                   8  // RW simpleProfileOtaLink_t - OTA link diagnostics
+#define SIMPLEPROFILE_OTA_ACTIVE              9  // R uint8 - TRUE while an OTA transfer is running
+#define SIMPLEPROFILE_CHAR9                   10 // R simpleProfileOtaResume_t - OTA resume point
+#define SIMPLEPROFILE_CHAR10                  11 // R simpleProfileOtaSwap_t - OTA hot swap and rollback
   
 // Simple Profile Service UUID
 #define SIMPLEPROFILE_SERV_UUID               0xFFF0
@@ -77,6 +84,11 @@ extern "C"
 #define SIMPLEPROFILE_CHAR3_UUID            0xFFF3
 #define SIMPLEPROFILE_CHAR4_UUID            0xFFF4
 #define SIMPLEPROFILE_CHAR5_UUID            0xFFF5
+#define SIMPLEPROFILE_CHAR6_UUID            0xFFF6
+#define SIMPLEPROFILE_CHAR7_UUID            0xFFF7
+#define SIMPLEPROFILE_CHAR8_UUID            0xFFF8
+#define SIMPLEPROFILE_CHAR9_UUID            0xFFF9
+#define SIMPLEPROFILE_CHAR10_UUID           0xFFFA
   
 // Simple Keys Profile Services bit fields
 #define SIMPLEPROFILE_SERVICE               0x00000001
@@ -87,10 +99,99 @@ extern "C"
 // Length of Characteristic 5 in bytes
 #define SIMPLEPROFILE_CHAR5_LEN           5  
 
+// Length of Characteristic 6 in bytes
+#define SIMPLEPROFILE_CHAR6_LEN           sizeof(simpleProfileOtaAck_t)
+
+// Length of Characteristic 7 in bytes
+#define SIMPLEPROFILE_CHAR7_LEN           sizeof(simpleProfileOtaCaps_t)
+
+// Length of Characteristic 8 in bytes
+#define SIMPLEPROFILE_CHAR8_LEN           sizeof(simpleProfileOtaLink_t)
+
+// Length of Characteristic 9 in bytes
+#define SIMPLEPROFILE_CHAR9_LEN           sizeof(simpleProfileOtaResume_t)
+
+// Length of Characteristic 10 in bytes
+#define SIMPLEPROFILE_CHAR10_LEN          sizeof(simpleProfileOtaSwap_t)
+
+// OTA window ack status
+#define SIMPLEPROFILE_OTA_ACK_BUSY        0  // transfer in progress
+#define SIMPLEPROFILE_OTA_ACK_DONE        1  // all chunks in, device swaps to the image once committed
+#define SIMPLEPROFILE_OTA_ACK_ERROR       2  // transfer dropped, the next chunk 0 starts a new one
+
+// Commands written to characteristic 10
+#define SIMPLEPROFILE_OTA_SWAP_ROLLBACK   1  // back to the previous image
+
 /*********************************************************************
  * TYPEDEFS
  */
 
+// OTA window ack, read or notified on characteristic 6. Every chunk below
+// base has been received; bit i of bitmap is set when chunk base + 1 + i
+// is buffered. The client retransmits the gaps only.
+#pragma pack(push, 1)
+typedef struct
+{
+  uint16 base;    // next chunk the device needs
+  uint8  bitmap;  // chunks buffered past base
+  uint8  status;  // SIMPLEPROFILE_OTA_ACK_*
+} simpleProfileOtaAck_t;
+
+// OTA capabilities, read from characteristic 7 before a transfer. Senders
+// size their chunks from maxChunk, which follows the negotiated ATT MTU.
+typedef struct
+{
+  uint16 maxChunk;  // payload bytes per version 2 chunk
+  uint8  window;    // chunks that may be in flight
+  uint8  version;   // newest chunk header understood
+} simpleProfileOtaCaps_t;
+
+// OTA link diagnostics, read from characteristic 8. The application asks
+// for a short connection interval while a transfer runs; the requested
+// values sit next to the ones the central actually granted. Intervals are
+// in units of 1.25ms.
+typedef struct
+{
+  uint16 minInterval;   // requested
+  uint16 maxInterval;   // requested
+  uint16 slaveLatency;  // requested
+  uint16 interval;      // current, 0 when not connected
+  uint16 latency;       // current
+  uint16 timeout;       // current supervision timeout, units of 10ms
+  uint8  fast;          // TRUE while the OTA parameters are requested
+} simpleProfileOtaLink_t;
+
+// OTA resume point, characteristic 9. A read returns how much of an
+// interrupted download is already in flash and the CRC32 of those bytes,
+// both 0 if there is nothing to continue. Writing a value starts a new
+// transfer: offset 0 downloads from scratch, the offset just read continues
+// the interrupted one and the chunks then carry the header, the image from
+// offset on and the CRC trailer. encoding says how the image bytes are
+// sent (OTA_ENC_* in Include/ota.h), e.g. as a delta against the image
+// the device runs.
+typedef struct
+{
+  uint32 offset;    // image bytes in flash
+  uint32 crc;       // CRC32 of image bytes 0..offset
+  uint8  encoding;  // of the transfer a write starts, 0 on read
+} simpleProfileOtaResume_t;
+
+// OTA hot swap diagnostics, read from characteristic 10. A committed image
+// is started in place of the running one without a reset (ota_swap() in
+// Include/ota.h); the device only resets when that fails. Times are those
+// of the last swap, in microseconds. Writing SIMPLEPROFILE_OTA_SWAP_ROLLBACK
+// goes back to the image before the running one the same way, with
+// ota_rollback(); rollbackRc then tells whether that was possible.
+typedef struct
+{
+  uint16 swaps;       // since boot
+  uint32 swapUs;      // from stopping the old payload to starting the new one
+  uint32 stopUs;      // of which waiting for the old payload to return
+  uint16 rollbacks;   // since boot
+  int8   rollbackRc;  // of the last rollback, 0 or OTA_ERR_* / FAPI_STATUS_*
+  uint8  trial;       // TRUE until the running payload calls ota_confirm()
+} simpleProfileOtaSwap_t;
+#pragma pack(pop)
   
 /*********************************************************************
  * MACROS
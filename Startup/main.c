@@ -209,6 +209,7 @@ int main()
 
   SimpleBLEPeripheral_createTask();
 
+  /* OTA payload task - DEFINE_TASK() priority, 1 by default */
   ota_startup();
 
   /* enable interrupts and start SYS/BIOS */
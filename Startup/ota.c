@@ -4,8 +4,13 @@
 #include <Include/ota.h>
 #include <driverlib/flash.h>
 #include <driverlib/vims.h>
+#include <xdc/std.h>
+#include <xdc/runtime/Timestamp.h>
 #include <ti/sysbios/hal/Hwi.h>
+#include <ti/sysbios/BIOS.h>
+#include <ti/sysbios/knl/Clock.h>
 #include <ti/sysbios/knl/Task.h>
+#include <ti/sysbios/knl/Semaphore.h>
 #include <ti/drivers/PWM.h>
 #include <driverlib/sys_ctrl.h>
 
@@ -23,6 +28,10 @@
 
 struct ota_region *OTA_REGION = (struct ota_region *) OTA_FLASH_BASE;
 
+/* A negative array size if the metadata outgrew what images are linked for */
+typedef char ota_metadata_size_check[
+    sizeof (void *) != 4 || sizeof (struct ota_metadata) == OTA_METADATA_SIZE ? 1 : -1];
+
 #define INVALID_GEN ((unsigned long) -1)
 
 #if _NEED_DISABLE_CACHE == 1
@@ -56,96 +65,232 @@ static void enable_cache(uint32_t state) {
 #endif
 
 #if _NEED_DISABLE_HWI == 1
-#define DISABLE_HWI() uint32_t _hwi = Hwi_disable()
-#define RESTORE_HWI() Hwi_restore(_hwi)
+#define DISABLE_HWI(fs) ((fs)->hwi = Hwi_disable())
+#define RESTORE_HWI(fs) Hwi_restore((fs)->hwi)
 #else
-#define DISABLE_HWI() ((void) 0)
-#define RESTORE_HWI() ((void) 0)
+#define DISABLE_HWI(fs) ((void) 0)
+#define RESTORE_HWI(fs) ((void) 0)
 #endif
 
 
 #if _NEED_DISABLE_CACHE == 1
-#define DISABLE_CACHE() uint32_t _cache = disable_cache()
-#define RESTORE_CACHE() enable_cache(_cache)
+#define DISABLE_CACHE(fs) ((fs)->cache = disable_cache())
+#define RESTORE_CACHE(fs) enable_cache((fs)->cache)
 #else
-#define DISABLE_CACHE() ((void) 0)
-#define RESTORE_CACHE() ((void) 0)
+#define DISABLE_CACHE(fs) ((void) 0)
+#define RESTORE_CACHE(fs) ((void) 0)
 #endif
 
-static uint32_t ota_FlashProgram(
-        uint8_t *pui8DataBuffer,
-        uint32_t ui32Address,
-        uint32_t ui32Count)
-{
-    DISABLE_HWI();
-    DISABLE_CACHE();
-
-    uint32_t rc = FlashProgram(pui8DataBuffer, ui32Address, ui32Count);
-
-    RESTORE_CACHE();
-    RESTORE_HWI();
-    return rc;
+struct ota_flash_stats ota_flash_stats;
+
+/*
+ * Flash erase/program/protect calls must run inside a flash session (HWIs
+ * masked, cache off). Open one session around a batch of operations rather
+ * than one per driverlib call; each session costs a VIMS off/on cycle.
+ */
+struct ota_flash_session {
+    uint32_t hwi;
+    uint32_t cache;
+    uint32_t start;
+};
+
+static void ota_flash_session_begin(struct ota_flash_session *fs) {
+    DISABLE_HWI(fs);
+    fs->start = Timestamp_get32();
+    DISABLE_CACHE(fs);
+    ota_flash_stats.sessions++;
 }
 
-static void ota_FlashProtectionSet(uint32_t ui32SectorAddress,
-                               uint32_t ui32ProtectMode) {
-    DISABLE_HWI();
-    DISABLE_CACHE();
+static void ota_flash_session_end(struct ota_flash_session *fs) {
+    RESTORE_CACHE(fs);
 
-    FlashProtectionSet(ui32SectorAddress, ui32ProtectMode);
+    uint32_t masked = Timestamp_get32() - fs->start;
+    ota_flash_stats.masked_ticks += masked;
+    if (masked > ota_flash_stats.masked_max_ticks)
+        ota_flash_stats.masked_max_ticks = masked;
 
-    RESTORE_CACHE();
-    RESTORE_HWI();
+    RESTORE_HWI(fs);
 }
 
+#define OTA_TASK_STACK_SIZE 1024
+#define OTA_TASK_PRIORITY 4
 
-static uint32_t ota_FlashSectorErase(uint32_t ui32SectorAddress) {
-    DISABLE_HWI();
-    DISABLE_CACHE();
+static uint8_t ota_task_stack[OTA_TASK_STACK_SIZE];
+static Task_Struct ota_task;
+
+struct ota_worker_stats ota_worker_stats;
+
+/*
+ * Chunk `seq` lives in slot seq % OTA_WORKER_SLOTS from the moment the write
+ * callback copies it out of the ATT PDU until the worker is done with it;
+ * nothing is copied in between. Slots before ota_ring_head belong to the
+ * worker, the others to the callback. One producer (the BLE stack task) and
+ * one consumer (the worker), so the free-running indices need no lock: each
+ * side only writes its own.
+ */
+static struct ota_worker_msg ota_ring[OTA_WORKER_SLOTS];
+static volatile unsigned ota_ring_head;
+static volatile unsigned ota_ring_tail;
+static Semaphore_Struct ota_ring_sem;
+static ota_worker_fn ota_worker_handler;
+
+static void ota_worker_task(UArg arg0, UArg arg1) {
+    for (;;) {
+        Semaphore_pend(Semaphore_handle(&ota_ring_sem), BIOS_WAIT_FOREVER);
+
+        while (ota_ring_tail != ota_ring_head) {
+            unsigned tail = ota_ring_tail;
+            struct ota_worker_msg *msg = &ota_ring[tail % OTA_WORKER_SLOTS];
+            ota_worker_handler(msg->buf, msg->len);
+            ota_ring_tail = tail + 1;
+        }
+    }
+}
 
-    uint32_t rc = FlashSectorErase(ui32SectorAddress);
+void ota_worker_start(ota_worker_fn fn) {
+    Task_Params params;
 
-    RESTORE_CACHE();
-    RESTORE_HWI();
+    ota_worker_handler = fn;
+    Semaphore_construct(&ota_ring_sem, 0, NULL);
 
-    return rc;
+    Task_Params_init(&params);
+    params.stack = ota_task_stack;
+    params.stackSize = OTA_TASK_STACK_SIZE;
+    params.priority = OTA_TASK_PRIORITY;
+    Task_construct(&ota_task, ota_worker_task, &params, NULL);
 }
 
-#define OTA_TASK_STACK_SIZE 1024
-#define OTA_TASK_PRIORITY 4
+struct ota_worker_msg *ota_worker_slot(unsigned seq) {
+    if (seq - ota_ring_tail >= OTA_WORKER_SLOTS) {
+        ota_worker_stats.full++;
+        return NULL;
+    }
+    return &ota_ring[seq % OTA_WORKER_SLOTS];
+}
 
-static uint8_t ota_task_stack[OTA_TASK_STACK_SIZE];
+void ota_worker_post(unsigned end) {
+    unsigned in_use = end - ota_ring_tail;
+
+    ota_worker_stats.posted += end - ota_ring_head;
+    if (in_use > ota_worker_stats.max_in_use)
+        ota_worker_stats.max_in_use = in_use;
+
+    ota_ring_head = end;
+    Semaphore_post(Semaphore_handle(&ota_ring_sem));
+}
+
+unsigned ota_worker_pending(void) {
+    return ota_ring_head - ota_ring_tail;
+}
 
 
 static inline ota_entrypoint_t ota_zone_entrypoint(struct ota_zone *zone) {
     uintptr_t ptr = (uintptr_t) zone;
-    ptr += (uintptr_t) zone->metadata.entrypoint;
+    ptr += OTA_ENTRYPOINT_OFFSET(zone->metadata.entrypoint);
     return (ota_entrypoint_t) ptr;
 }
 
-static void __ota_startup() {
-    ota_entrypoint_t entrypoint = ota_zone_entrypoint(&OTA_REGION->zones[OTA_ACTIVE_ZONE]);
+static inline int ota_zone_valid(struct ota_zone *zone) {
+    return zone->metadata.done == OTA_DONE_MAGIC;
+}
+
+/* Committed and not revoked: the zone may run */
+static inline int ota_zone_usable(struct ota_zone *zone) {
+    return ota_zone_valid(zone) && zone->metadata.revoked != OTA_REVOKED_MAGIC;
+}
+
+static void __ota_load(struct ota_zone *zone, const struct ota_load *load) {
+    if (!load->len || load->dest == OTA_LOAD_TABLE || load->dest == OTA_LOAD_TASK)
+        return;
+
+    void *dst = (void *) load->dest;
+    if (load->offset == OTA_LOAD_ZERO_FILL) {
+        memset(dst, 0, load->len);
+        return;
+    }
+
+    void *src = (void *) (_UINT(&zone->payload) + load->offset);
+    memcpy(dst, src, load->len);
+}
+
+static Task_Struct ota_payload_task;
+static volatile uint8_t ota_payload_stop;
+
+struct ota_swap_stats ota_swap_stats;
+
+int ota_payload_stopping(void) {
+    return ota_payload_stop;
+}
+
+/* At boot, created before BIOS_start(), so it runs once the scheduler does. */
+static void ota_payload_start(ota_entrypoint_t fn, size_t stack_size, int priority) {
+    Task_Params params;
+
+    Task_Params_init(&params);
+    // A NULL stack comes from the default heap, so only the size is fixed
+    params.stackSize = stack_size ? stack_size : OTA_PAYLOAD_STACK_SIZE;
+    params.priority = priority ? priority : OTA_PAYLOAD_PRIORITY;
+    Task_construct(&ota_payload_task, fn, &params, NULL);
+}
+
+static void __ota_startup(struct ota_zone *zone) {
+    ota_entrypoint_t entrypoint = ota_zone_entrypoint(zone);
     for (int i = 0; i < OTA_MAX_LOADS; i++) {
-        struct ota_load *load = &OTA_REGION->zones[OTA_ACTIVE_ZONE].metadata.loads[i];
-        if (!load->len)
+        struct ota_load *load = &zone->metadata.loads[i];
+        if (load->dest != OTA_LOAD_TABLE) {
+            __ota_load(zone, load);
             continue;
+        }
 
-        void *dst = (void *) load->dest;
-        void *src = (void *) (_UINT(&OTA_REGION->zones[OTA_ACTIVE_ZONE].payload) + load->offset);
-        memcpy(dst, src, load->len);
+        // Walked in place; the table is part of the CRC-checked payload
+        const struct ota_load *table = (const struct ota_load *) &zone->payload[load->offset];
+        if (load->offset + load->len * sizeof (*table) > zone->metadata.size)
+            continue;
+        for (size_t j = 0; j < load->len; j++)
+            __ota_load(zone, &table[j]);
     }
 
-    entrypoint(0, 0);
+    ota_payload_start(entrypoint, zone->metadata.task_stack_size,
+                      zone->metadata.task_priority);
+}
+
+int ota_live_zone(void) {
+#if OTA_BOOT_XIP == 1
+    struct ota_zone *a = &OTA_REGION->zones[OTA_ACTIVE_ZONE];
+    struct ota_zone *b = &OTA_REGION->zones[OTA_INACTIVE_ZONE];
+
+    if (ota_zone_usable(b) &&
+        (!ota_zone_usable(a) || b->metadata.gen > a->metadata.gen))
+        return OTA_INACTIVE_ZONE;
+#endif
+    return OTA_ACTIVE_ZONE;
+}
+
+int ota_dl_target_zone(void) {
+#if OTA_BOOT_XIP == 1
+    return NR_OTA_ZONES - 1 - ota_live_zone();
+#else
+    return OTA_INACTIVE_ZONE;
+#endif
 }
 
+int ota_dl_link_zone(void) {
+#if OTA_BOOT_XIP == 1
+    return ota_dl_target_zone();
+#else
+    return OTA_ACTIVE_ZONE;
+#endif
+}
+
+#if OTA_BOOT_XIP == 0
 #define OTA_COPY_CHUNK 256
 
 static int __ota_copy_zone(struct ota_zone *dst, struct ota_zone *src) {
     struct ota_dl_params p;
     struct ota_dl_state s;
-    uint8_t buf[OTA_COPY_CHUNK];
     int ret;
 
+    ota_dl_params_init(&p);
     p.dl_size = src->metadata.size;
     p.entrypoint = src->metadata.entrypoint;
     memcpy(
@@ -153,10 +298,14 @@ static int __ota_copy_zone(struct ota_zone *dst, struct ota_zone *src) {
             &src->metadata.loads,
             sizeof (struct ota_load) * OTA_MAX_LOADS
     );
+    p.task_stack_size = src->metadata.task_stack_size;
+    p.task_priority = src->metadata.task_priority;
 
     ota_dl_init(&s, &p);
     s.target_zone = dst;
     s.target_gen = src->metadata.gen + 1;
+    s.check_crc = 1;
+    s.expected_crc = src->metadata.crc;
 
     ret = ota_dl_begin(&s);
     if (ret != FAPI_STATUS_SUCCESS)
@@ -164,18 +313,24 @@ static int __ota_copy_zone(struct ota_zone *dst, struct ota_zone *src) {
 
     while (s.dl_done < s.dl_size) {
         size_t len = min(OTA_COPY_CHUNK, s.dl_size - s.dl_done);
-        memcpy(buf, &src->payload[s.dl_done], len);
-        ret = ota_dl_process(&s, buf, len);
+        // ota_dl_process stages into RAM, so the source can stay in flash
+        ret = ota_dl_process(&s, &src->payload[s.dl_done], len);
         if (ret != FAPI_STATUS_SUCCESS)
             return ret;
     }
 
     return ota_dl_finish(&s);
 }
+#endif
 
 extern void payload_test_app(UArg arg1, UArg arg2);
 
-void ota_startup(void) {
+/* The zone to run, after copying a newer image over it; NULL if none. */
+static struct ota_zone *ota_boot_zone(void) {
+#if OTA_BOOT_XIP == 1
+    // Run whichever zone holds the newest committed image, in place
+    struct ota_zone *act = &OTA_REGION->zones[ota_live_zone()];
+#else
     // Check if inactive image is newer, if it is, copy over active and reset
     struct ota_zone *act = &OTA_REGION->zones[OTA_ACTIVE_ZONE];
     struct ota_zone *inact = &OTA_REGION->zones[OTA_INACTIVE_ZONE];
@@ -194,14 +349,193 @@ void ota_startup(void) {
 //            SysCtrlSystemReset();
         }
     }
+#endif
+
+    return ota_zone_usable(act) ? act : NULL;
+}
+
+#if OTA_BOOT_XIP == 1
+/* Programs one of the boot-confirm marks of a committed zone. */
+static int ota_zone_mark(uint32_t *mark, uint32_t magic) {
+    struct ota_flash_session fs;
+
+    ota_flash_session_begin(&fs);
+    int rc = FlashProgram((uint8_t *) &magic, (uint32_t) mark, sizeof (magic));
+    ota_flash_session_end(&fs);
+    return rc;
+}
+#endif
+
+struct ota_rollback_stats ota_rollback_stats;
 
-    if (act->metadata.done == OTA_DONE_MAGIC) {
-        __ota_startup();
+#if OTA_BOOT_XIP == 1 && OTA_CONFIRM_TIMEOUT_MS
+static struct ota_zone *ota_trial_zone;     /* waiting for ota_confirm() */
+static Clock_Struct ota_confirm_clock;
+static uint8_t ota_confirm_clock_made;
+
+/* Not confirmed yet, and the other zone holds an image to go back to */
+static int ota_zone_on_trial(struct ota_zone *zone) {
+    struct ota_zone *other = &OTA_REGION->zones[NR_OTA_ZONES - 1 - (zone - OTA_REGION->zones)];
+
+    return zone->metadata.confirmed != OTA_CONFIRMED_MAGIC && ota_zone_usable(other);
+}
+
+/* Runs in Swi context: the next boot finds the zone booted and revokes it */
+static void ota_confirm_expired(UArg arg) {
+    (void) arg;
+    SysCtrlSystemReset();
+}
+
+static void ota_trial_start(struct ota_zone *zone) {
+    UInt32 timeout = OTA_CONFIRM_TIMEOUT_MS * (1000 / Clock_tickPeriod);
+    Clock_Params params;
+
+    // Refused for a zone committed since reset, whose next boot is then
+    // a trial of its own
+    ota_zone_mark(&zone->metadata.booted, OTA_BOOTED_MAGIC);
+
+    if (!ota_confirm_clock_made) {
+        Clock_Params_init(&params);
+        Clock_construct(&ota_confirm_clock, ota_confirm_expired, timeout, &params);
+        ota_confirm_clock_made = 1;
+    }
+    Clock_setTimeout(Clock_handle(&ota_confirm_clock), timeout);
+    Clock_start(Clock_handle(&ota_confirm_clock));
+    ota_trial_zone = zone;
+}
+
+static void ota_trial_end(void) {
+    if (ota_confirm_clock_made)
+        Clock_stop(Clock_handle(&ota_confirm_clock));
+    ota_trial_zone = NULL;
+}
+#endif
+
+void ota_startup(void) {
+    struct ota_zone *act = ota_boot_zone();
+
+#if OTA_BOOT_XIP == 1 && OTA_CONFIRM_TIMEOUT_MS
+    ota_trial_end();
+    if (act && ota_zone_on_trial(act) &&
+        act->metadata.booted == OTA_BOOTED_MAGIC) {
+        // Started before and never confirmed: back to the previous image
+        ota_zone_mark(&act->metadata.revoked, OTA_REVOKED_MAGIC);
+        act = ota_boot_zone();
+    }
+    if (act && ota_zone_on_trial(act))
+        ota_trial_start(act);
+#endif
+
+    if (act) {
+        __ota_startup(act);
     }
     else {
-        payload_test_app(0, 0);
+        ota_payload_start(payload_test_app, 0, 0);
+    }
+
+}
+
+#if OTA_BOOT_XIP != 1
+/* Whether a commit since reset left the active zone write-protected. */
+static int ota_active_locked(void) {
+    uint32_t base = (uint32_t) &OTA_REGION->zones[OTA_ACTIVE_ZONE];
+    uint32_t sector_size = FlashSectorSizeGet();
+
+    for (uint32_t a = base; a < base + sizeof (struct ota_zone); a += sector_size) {
+        if (FlashProtectionGet(a) == FLASH_WRITE_PROTECT)
+            return 1;
+    }
+    return 0;
+}
+#endif
+
+/* Waits for the payload task to return and disposes of it. */
+static int ota_payload_end(void) {
+    Task_Handle task = Task_handle(&ota_payload_task);
+
+    ota_payload_stop = 1;
+    for (unsigned ms = 0; Task_getMode(task) != Task_Mode_TERMINATED; ms++) {
+        if (ms == OTA_SWAP_TIMEOUT_MS) {
+            ota_payload_stop = 0;
+            return OTA_ERR_SWAP_TIMEOUT;
+        }
+        // Lets the payload run on to a safe point
+        Task_sleep(1000 / Clock_tickPeriod);
+    }
+    ota_payload_stop = 0;
+
+    Task_destruct(&ota_payload_task);
+    return 0;
+}
+
+/*
+ * Called from a task other than the payload's, e.g. the OTA worker once a
+ * download is committed. Without OTA_BOOT_XIP the new image is copied over
+ * the active zone first, as at boot; the old one is not running any more
+ * by then.
+ */
+int ota_swap(void) {
+    uint32_t start = Timestamp_get32();
+
+#if OTA_BOOT_XIP != 1
+    if (ota_active_locked())
+        return OTA_ERR_SWAP_LOCKED;
+#endif
+
+    int rc = ota_payload_end();
+    if (rc) {
+        ota_swap_stats.timeouts++;
+        return rc;
     }
+    ota_swap_stats.stop_ticks = Timestamp_get32() - start;
+
+    ota_startup();
+
+    ota_swap_stats.swaps++;
+    ota_swap_stats.swap_ticks = Timestamp_get32() - start;
+    return 0;
+}
 
+int ota_confirm(void) {
+#if OTA_BOOT_XIP == 1 && OTA_CONFIRM_TIMEOUT_MS
+    struct ota_zone *zone = ota_trial_zone;
+
+    if (!zone)
+        return 0;
+    ota_trial_end();
+    return ota_zone_mark(&zone->metadata.confirmed, OTA_CONFIRMED_MAGIC);
+#else
+    return 0;
+#endif
+}
+
+int ota_on_trial(void) {
+#if OTA_BOOT_XIP == 1 && OTA_CONFIRM_TIMEOUT_MS
+    return ota_trial_zone != NULL;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Only metadata changes: the running zone is revoked, which makes the other
+ * one live again. With nothing left to go back to, that image does not run
+ * on trial.
+ */
+int ota_rollback(void) {
+    int rc = OTA_ERR_NO_ROLLBACK;
+
+#if OTA_BOOT_XIP == 1
+    struct ota_zone *live = &OTA_REGION->zones[ota_live_zone()];
+    struct ota_zone *prev = &OTA_REGION->zones[ota_dl_target_zone()];
+
+    if (ota_zone_usable(live) && ota_zone_usable(prev))
+        rc = ota_zone_mark(&live->metadata.revoked, OTA_REVOKED_MAGIC);
+#endif
+    if (!rc)
+        ota_rollback_stats.rollbacks++;
+    ota_rollback_stats.last_rc = rc;
+    return rc;
 }
 
 void ota_dl_params_init(struct ota_dl_params *params) {
@@ -210,26 +544,68 @@ void ota_dl_params_init(struct ota_dl_params *params) {
         params->loads[i].offset = 0;
         params->loads[i].len = 0;
     }
+    params->task_stack_size = 0;
+    params->task_priority = 0;
+    params->encoding = OTA_ENC_RAW;
 }
 
 void ota_dl_init(struct ota_dl_state *state, struct ota_dl_params *params) {
-    state->target_zone = &OTA_REGION->zones[OTA_INACTIVE_ZONE];
-    if (OTA_REGION->zones[OTA_ACTIVE_ZONE].metadata.done == OTA_DONE_MAGIC)
-        state->target_gen = OTA_REGION->zones[OTA_ACTIVE_ZONE].metadata.gen + 1;
+    struct ota_zone *live = &OTA_REGION->zones[ota_live_zone()];
+
+    state->target_zone = &OTA_REGION->zones[ota_dl_target_zone()];
+    if (ota_zone_valid(live))
+        state->target_gen = live->metadata.gen + 1;
     else
         state->target_gen = 0;
 
+    memset(&ota_flash_stats, 0, sizeof (ota_flash_stats));
+
     state->dl_done = 0;
+    state->row_len = 0;
+    state->crc = 0;
+    state->check_crc = 0;
+    state->expected_crc = 0;
+    state->resumed = 0;
+    state->encoding = params->encoding;
+    state->base_zone = live;
+    state->base_checked = 0;
+    state->op_len = 0;
+    state->op_left = 0;
     state->dl_size = params->dl_size;
     state->entrypoint = params->entrypoint;
     state->sector_size = FlashSectorSizeGet();
     state->nr_sectors = sizeof (struct ota_zone) / state->sector_size;
 
+    state->task_stack_size = params->task_stack_size;
+    state->task_priority = params->task_priority;
+
     for (int i = 0; i < OTA_MAX_LOADS; i++) {
-        state->loads[i].dest = params->loads[i].dest;
-        state->loads[i].offset = params->loads[i].offset;
-        state->loads[i].len = params->loads[i].len;
+        const struct ota_load *load = &params->loads[i];
+
+        // Sent as a load, kept in the metadata fields
+        if (load->dest == OTA_LOAD_TASK) {
+            state->task_priority = load->offset;
+            state->task_stack_size = load->len;
+            state->loads[i].dest = 0;
+            state->loads[i].offset = 0;
+            state->loads[i].len = 0;
+            continue;
+        }
+        state->loads[i].dest = load->dest;
+        state->loads[i].offset = load->offset;
+        state->loads[i].len = load->len;
     }
+
+    // Same image parameters, same id: the sender checks the payload CRC
+    state->progress_id = ota_crc32(0, (uint8_t *) &state->dl_size, sizeof (size_t));
+    state->progress_id = ota_crc32(state->progress_id,
+            (uint8_t *) &state->entrypoint, sizeof (ota_entrypoint_t));
+    state->progress_id = ota_crc32(state->progress_id,
+            (uint8_t *) state->loads, sizeof (struct ota_load) * OTA_MAX_LOADS);
+    state->progress_id = ota_crc32(state->progress_id,
+            (uint8_t *) &state->task_stack_size, sizeof (uint16_t));
+    state->progress_id = ota_crc32(state->progress_id,
+            (uint8_t *) &state->task_priority, sizeof (uint16_t));
 }
 
 #define _first_sector(state)    \
@@ -239,79 +615,463 @@ void ota_dl_init(struct ota_dl_state *state, struct ota_dl_params *params) {
     (_first_sector(state) + state->nr_sectors)
 
 #define FOREACH_SECTOR(state, idx)                  \
-    for (int idx = _first_sector(state); idx < _last_sector(state); i++)
-
+    for (int idx = _first_sector(state); idx < _last_sector(state); idx++)
+
+#define _meta_sector(state)     \
+    (((uint32_t) &state->target_zone->metadata) / state->sector_size)
+
+/*
+ * Only the metadata sector is erased up front, which is enough to invalidate
+ * whatever image the zone held. Payload sectors are erased by
+ * ota_dl_erase_upto() right before the first row lands in them, so small
+ * images never touch the rest of the zone. With the 8 KiB region the linker
+ * script reserves, a zone is a single sector and only the metadata erase
+ * ever happens; the lazy erase pays off with a larger OTA_FLASH_SIZE.
+ */
 int ota_dl_begin(struct ota_dl_state *state) {
-    FOREACH_SECTOR(state, i) {
-        uint32_t rc;
+    struct ota_flash_session fs;
+    struct ota_progress *pr = &state->target_zone->metadata.progress;
+    uint32_t hdr[2] = { OTA_PROGRESS_MAGIC, state->progress_id };
+    uint32_t rc;
+
+    if (state->dl_size > OTA_PAYLOAD_SIZE)
+        return FAPI_STATUS_INCORRECT_DATABUFFER_LENGTH;
+
+    if (OTA_ENTRYPOINT_ZONE(state->entrypoint) != ota_dl_link_zone())
+        return OTA_ERR_ZONE_MISMATCH;
+
+    state->next_erase = _first_sector(state);
+
+#if OTA_BOOT_XIP == 1 && OTA_CONFIRM_TIMEOUT_MS
+    // The image a trial would go back to is about to be erased
+    if (ota_trial_zone)
+        ota_trial_end();
+#endif
+
+    ota_flash_session_begin(&fs);
+    FlashProtectionSet(_meta_sector(state) * state->sector_size, FLASH_NO_PROTECT);
+    rc = FlashSectorErase(_meta_sector(state) * state->sector_size);
+    if (rc == FAPI_STATUS_SUCCESS)
+        rc = FlashProgram((uint8_t *) hdr, (uint32_t) &pr->magic, sizeof (hdr));
+    ota_flash_session_end(&fs);
+
+    return (int) rc;
+}
+
+/*
+ * Checkpoint of the uncommitted download in the target zone at dl_done, or
+ * the latest one for OTA_CHECKPOINT_LATEST. NULL if there is none.
+ */
+#define OTA_CHECKPOINT_LATEST ((size_t) -1)
+
+static struct ota_checkpoint *ota_dl_checkpoint(struct ota_zone *zone, size_t dl_done) {
+    struct ota_progress *pr = &zone->metadata.progress;
+
+    if (ota_zone_valid(zone) || pr->magic != OTA_PROGRESS_MAGIC)
+        return NULL;
+
+    for (int i = OTA_NR_CHECKPOINTS - 1; i >= 0; i--) {
+        if (pr->cp[i].dl_done == 0xffffffff)
+            continue;
+        if (dl_done == OTA_CHECKPOINT_LATEST || pr->cp[i].dl_done == dl_done)
+            return &pr->cp[i];
+    }
+    return NULL;
+}
+
+/* Where a sender can continue: OTA_ERR_NO_RESUME if nowhere. */
+int ota_dl_resume_point(size_t *dl_done, uint32_t *crc) {
+    struct ota_checkpoint *cp = ota_dl_checkpoint(
+            &OTA_REGION->zones[ota_dl_target_zone()], OTA_CHECKPOINT_LATEST);
+
+    if (!cp)
+        return OTA_ERR_NO_RESUME;
+
+    *dl_done = cp->dl_done;
+    *crc = cp->crc;
+    return 0;
+}
+
+/* Makes the zone's progress record unusable; caller holds a session. */
+static void ota_dl_drop_progress(struct ota_dl_state *state) {
+    uint32_t zero = 0;
+
+    FlashProgram((uint8_t *) &zero,
+            (uint32_t) &state->target_zone->metadata.progress.magic,
+            sizeof (zero));
+}
+
+/*
+ * Continues the download recorded in the target zone from its checkpoint at
+ * dl_done instead of starting over: state must come from ota_dl_init() with
+ * the same parameters. The
+ * sector holding the checkpoint was erased by the interrupted download, and
+ * a sector that starts exactly at it is erased again. Rows programmed after
+ * the checkpoint are compared rather than programmed by ota_dl_flush().
+ */
+int ota_dl_resume(struct ota_dl_state *state, size_t dl_done) {
+    struct ota_flash_session fs;
+    struct ota_checkpoint *cp = ota_dl_checkpoint(state->target_zone, dl_done);
+    int rc = 0;
+
+    if (state->dl_size > OTA_PAYLOAD_SIZE)
+        return FAPI_STATUS_INCORRECT_DATABUFFER_LENGTH;
+
+    if (OTA_ENTRYPOINT_ZONE(state->entrypoint) != ota_dl_link_zone())
+        return OTA_ERR_ZONE_MISMATCH;
+
+    if (!cp)
+        return OTA_ERR_NO_RESUME;
+
+    ota_flash_session_begin(&fs);
+    FlashProtectionSet(_meta_sector(state) * state->sector_size, FLASH_NO_PROTECT);
+    if (state->target_zone->metadata.progress.id != state->progress_id ||
+        cp->dl_done > state->dl_size) {
+        // A different image; the next attempt starts from scratch
+        ota_dl_drop_progress(state);
+        rc = OTA_ERR_RESUME_MISMATCH;
+    }
+    ota_flash_session_end(&fs);
+
+    if (rc)
+        return rc;
+
+    uint32_t addr = (uint32_t) &state->target_zone->payload[cp->dl_done];
+
+    state->dl_done = cp->dl_done;
+    state->crc = cp->crc;
+    state->next_erase = (addr + state->sector_size - 1) / state->sector_size;
+    state->resumed = 1;
+    return 0;
+}
+
+/* Erases payload sectors up to the one holding addr; caller holds a session. */
+static int ota_dl_erase_upto(struct ota_dl_state *state, uint32_t addr) {
+    for (; state->next_erase <= addr / state->sector_size; state->next_erase++) {
+        if (state->next_erase == _meta_sector(state))
+            continue;
 
-        ota_FlashProtectionSet(i * state->sector_size, FLASH_NO_PROTECT);
+        FlashProtectionSet(state->next_erase * state->sector_size, FLASH_NO_PROTECT);
 
-        rc = ota_FlashSectorErase(i * state->sector_size);
+        uint32_t rc = FlashSectorErase(state->next_erase * state->sector_size);
         if (rc != FAPI_STATUS_SUCCESS)
             return (int) rc;
     }
     return 0;
 }
 
-int ota_dl_process(struct ota_dl_state *state, uint8_t *buf, size_t len)  {
-        int rc = ota_FlashProgram(
-                buf,
-                (uint32_t) &state->target_zone->payload[state->dl_done],
-                len);
+static int ota_flash_blank(const uint8_t *p, size_t len) {
+    while (len--) {
+        if (*p++ != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Programs a row but for the OTA_ERASED_BLOCK blocks of it that are all 0xff,
+ * one FlashProgram() per run of blocks that are not.
+ */
+static int ota_dl_program(const uint8_t *buf, uint32_t addr, size_t len) {
+    size_t i = 0;
+
+    while (i < len) {
+        size_t start = i;
+
+        while (i < len && !ota_flash_blank(&buf[i], min(OTA_ERASED_BLOCK, len - i)))
+            i += OTA_ERASED_BLOCK;
+        i = min(i, len);
+
+        if (i > start) {
+            uint32_t rc = FlashProgram((uint8_t *) &buf[start], addr + start, i - start);
+            if (rc != FAPI_STATUS_SUCCESS)
+                return (int) rc;
+        }
+
+        while (i < len && ota_flash_blank(&buf[i], min(OTA_ERASED_BLOCK, len - i)))
+            i += OTA_ERASED_BLOCK;
+    }
+    return 0;
+}
+
+/* Programs the staged row; the caller holds a flash session. */
+static int ota_dl_flush(struct ota_dl_state *state) {
+    if (!state->row_len)
+        return 0;
+
+    uint32_t addr = (uint32_t) &state->target_zone->payload[state->dl_done - state->row_len];
+    int rc = ota_dl_erase_upto(state, addr + state->row_len - 1);
+    if (rc != FAPI_STATUS_SUCCESS)
+        return rc;
+
+    if (state->resumed && !ota_flash_blank((uint8_t *) addr, state->row_len)) {
+        // Programmed after the last checkpoint, before the interruption
+        if (memcmp((void *) addr, state->row_buf, state->row_len)) {
+            ota_dl_drop_progress(state);
+            return OTA_ERR_RESUME_MISMATCH;
+        }
+    }
+    else {
+        // row_buf always starts on a row boundary of the payload
+        rc = ota_dl_program(state->row_buf, addr, state->row_len);
+
+        if (rc != FAPI_STATUS_SUCCESS)
+            return rc;
+    }
+
+    if (state->row_len == OTA_FLASH_ROW_SIZE &&
+        state->dl_done % (OTA_CHECKPOINT_ROWS * OTA_FLASH_ROW_SIZE) == 0) {
+        size_t n = state->dl_done / (OTA_CHECKPOINT_ROWS * OTA_FLASH_ROW_SIZE) - 1;
+        struct ota_checkpoint *cp = &state->target_zone->metadata.progress.cp[n];
+        struct ota_checkpoint rec = { state->dl_done, state->crc };
+
+        if (n < OTA_NR_CHECKPOINTS && cp->dl_done == 0xffffffff) {
+            rc = FlashProgram((uint8_t *) &rec, (uint32_t) cp, sizeof (rec));
+            if (rc != FAPI_STATUS_SUCCESS)
+                return rc;
+        }
+    }
+
+    state->row_len = 0;
+    return 0;
+}
+
+/* Appends payload bytes, a flash row at a time; erased ones if buf is NULL. */
+static int ota_dl_write(struct ota_dl_state *state, const uint8_t *buf, size_t len) {
+    if (state->dl_done + len > state->dl_size)
+        return FAPI_STATUS_INCORRECT_DATABUFFER_LENGTH;
+
+    while (len) {
+        size_t n = min(len, OTA_FLASH_ROW_SIZE - state->row_len);
+        uint8_t *to = &state->row_buf[state->row_len];
+
+        if (buf) {
+            memcpy(to, buf, n);
+            buf += n;
+        }
+        else {
+            memset(to, 0xff, n);
+        }
+        // Kept exact at every row boundary for the checkpoints
+        state->crc = ota_crc32(state->crc, to, n);
+        state->row_len += n;
+        state->dl_done += n;
+        len -= n;
+
+        if (state->row_len == OTA_FLASH_ROW_SIZE) {
+            struct ota_flash_session fs;
+
+            ota_flash_session_begin(&fs);
+            int rc = ota_dl_flush(state);
+            ota_flash_session_end(&fs);
+
+            if (rc != FAPI_STATUS_SUCCESS)
+                return rc;
+        }
+    }
+    return 0;
+}
 
+/*
+ * Appends len bytes that start distance bytes back in the payload, a piece
+ * at a time: each piece is already in flash or staged in row_buf, and ends
+ * before ota_dl_write() flushes the row it is read from.
+ */
+static int ota_dl_repeat(struct ota_dl_state *state, size_t distance, size_t len) {
+    if (distance > state->dl_done)
+        return OTA_ERR_BAD_STREAM;
+
+    while (len) {
+        size_t src = state->dl_done - distance;
+        size_t staged = state->dl_done - state->row_len;
+        size_t n = min(len, distance);
+        const uint8_t *from;
+
+        n = min(n, OTA_FLASH_ROW_SIZE - state->row_len);
+        if (src >= staged) {
+            from = &state->row_buf[src - staged];
+        }
+        else {
+            from = &state->target_zone->payload[src];
+            n = min(n, staged - src);
+        }
+
+        int rc = ota_dl_write(state, from, n);
         if (rc != FAPI_STATUS_SUCCESS)
             return rc;
+        len -= n;
+    }
+    return 0;
+}
 
-        state->dl_done += len;
+/* Length of the op started in state->op, 0 if there is no such op. */
+static size_t ota_dl_op_size(struct ota_dl_state *state) {
+    if (state->op[0] < OTA_OP_LITERAL_MAX)
+        return 1;
+
+    switch (state->encoding) {
+    case OTA_ENC_SPARSE:
+        return 1;
+    case OTA_ENC_DELTA:
+        return state->op[0] == OTA_OP_COPY ? OTA_OP_MAX_SIZE : 0;
+    case OTA_ENC_LZ:
+        if (state->op_len < 2)
+            return 2;
+        return state->op[1] & OTA_OP_FAR ? 3 : 2;
+    }
+    return 0;
+}
+
+/* Runs the complete op in state->op; see OTA_ENC_* in ota.h. */
+static int ota_dl_op(struct ota_dl_state *state) {
+    struct ota_zone *base = state->base_zone;
+    uint8_t *op = state->op;
+    size_t offset, len;
+
+    if (op[0] < OTA_OP_LITERAL_MAX) {
+        state->op_left = op[0] + 1;
         return 0;
+    }
+
+    if (state->encoding == OTA_ENC_SPARSE)
+        return ota_dl_write(state, NULL, (op[0] & 0x7f) + 1);
+
+    if (state->encoding == OTA_ENC_LZ) {
+        len = (op[0] & 0x7f) + OTA_OP_MATCH_MIN;
+        if (op[1] & OTA_OP_FAR)
+            offset = (((op[1] & 0x7f) << 8) | op[2]) + 1;
+        else
+            offset = op[1] + 1;
+        return ota_dl_repeat(state, offset, len);
+    }
+
+    offset = op[1] | (op[2] << 8);
+    len = op[3] | (op[4] << 8);
+    if (offset + len > base->metadata.size)
+        return OTA_ERR_BAD_STREAM;
+
+    // ota_dl_write stages into RAM, so the source can stay in flash
+    return ota_dl_write(state, &base->payload[offset], len);
 }
 
-int ota_dl_finish(struct ota_dl_state *state) {
-    unsigned long magic = OTA_DONE_MAGIC;
+/* Takes an op stream apart; literal bytes go straight to ota_dl_write(). */
+static int ota_dl_ops(struct ota_dl_state *state, const uint8_t *buf, size_t len) {
+    while (len) {
+        if (state->op_left) {
+            size_t n = min(len, state->op_left);
+            int rc = ota_dl_write(state, buf, n);
+            if (rc != FAPI_STATUS_SUCCESS)
+                return rc;
+            state->op_left -= n;
+            buf += n;
+            len -= n;
+            continue;
+        }
 
-    int rc = ota_FlashProgram(
-            (uint8_t *) &state->dl_size,
-            (uint32_t) &state->target_zone->metadata.size,
-            sizeof (size_t));
+        state->op[state->op_len++] = *buf++;
+        len--;
 
-    if (rc != FAPI_STATUS_SUCCESS)
-        return (int) rc;
+        if (state->encoding == OTA_ENC_DELTA && !state->base_checked) {
+            uint32_t crc;
 
-    rc = ota_FlashProgram(
-            (uint8_t *) &state->entrypoint,
-            (uint32_t) &state->target_zone->metadata.entrypoint,
-            sizeof (ota_entrypoint_t));
+            if (state->op_len < sizeof (crc))
+                continue;
+            memcpy(&crc, state->op, sizeof (crc));
+            if (!ota_zone_valid(state->base_zone) ||
+                state->base_zone->metadata.crc != crc)
+                return OTA_ERR_DELTA_BASE;
+            state->base_checked = 1;
+            state->op_len = 0;
+            continue;
+        }
 
-    if (rc != FAPI_STATUS_SUCCESS)
-        return (int) rc;
+        size_t size = ota_dl_op_size(state);
+        if (!size)
+            return OTA_ERR_BAD_STREAM;
+        if (state->op_len < size)
+            continue;
 
-    rc = ota_FlashProgram(
-            (uint8_t *) &state->target_gen,
-            (uint32_t) &state->target_zone->metadata.gen,
-            sizeof (unsigned long));
+        state->op_len = 0;
+        int rc = ota_dl_op(state);
+        if (rc != FAPI_STATUS_SUCCESS)
+            return rc;
+    }
+    return 0;
+}
 
+/*
+ * Takes the next len bytes of the download stream, encoded as set in the
+ * params: the payload itself, or ops that produce it.
+ */
+int ota_dl_process(struct ota_dl_state *state, uint8_t *buf, size_t len) {
+    switch (state->encoding) {
+    case OTA_ENC_RAW:
+        return ota_dl_write(state, buf, len);
+    case OTA_ENC_DELTA:
+    case OTA_ENC_LZ:
+    case OTA_ENC_SPARSE:
+        return ota_dl_ops(state, buf, len);
+    }
+    return OTA_ERR_BAD_STREAM;
+}
+
+static int __ota_dl_commit(struct ota_dl_state *state) {
+    struct ota_metadata md;
+    unsigned long magic = OTA_DONE_MAGIC;
+
+    int rc = ota_dl_flush(state);
     if (rc != FAPI_STATUS_SUCCESS)
-        return (int) rc;
+        return rc;
+
+    // Leave the zone uncommitted (and unbootable) if the image is incomplete
+    // or corrupt
+    if (state->dl_done != state->dl_size)
+        return FAPI_STATUS_INCORRECT_DATABUFFER_LENGTH;
+
+    // A corrupt image is not worth resuming either
+    if (state->check_crc && state->crc != state->expected_crc) {
+        ota_dl_drop_progress(state);
+        return OTA_ERR_CRC_MISMATCH;
+    }
 
-    rc = ota_FlashProgram(
-            (uint8_t *) &state->loads,
-            (uint32_t) &state->target_zone->metadata.loads,
-            sizeof (struct ota_load) * OTA_MAX_LOADS);
+    memset(&md, 0xff, sizeof (md));
+    md.gen = state->target_gen;
+    md.entrypoint = state->entrypoint;
+    md.size = state->dl_size;
+    memcpy(md.loads, state->loads, sizeof (struct ota_load) * OTA_MAX_LOADS);
+    md.task_stack_size = state->task_stack_size;
+    md.task_priority = state->task_priority;
+    md.crc = state->crc;
+
+    rc = FlashProgram(
+            (uint8_t *) &md,
+            (uint32_t) &state->target_zone->metadata,
+            OTA_METADATA_RECORD_SIZE);
 
     if (rc != FAPI_STATUS_SUCCESS)
-        return (int) rc;
+        return rc;
 
-    rc = ota_FlashProgram(
+    // The magic goes in last: it is what makes the zone bootable
+    rc = FlashProgram(
             (uint8_t *) &magic,
             (uint32_t) &state->target_zone->metadata.done,
             sizeof (unsigned long));
 
     if (rc != FAPI_STATUS_SUCCESS)
-        return (int) rc;
+        return rc;
 
     FOREACH_SECTOR(state, i) {
-        ota_FlashProtectionSet(i * state->sector_size, FLASH_WRITE_PROTECT);
+        FlashProtectionSet(i * state->sector_size, FLASH_WRITE_PROTECT);
     }
     return 0;
 }
+
+int ota_dl_finish(struct ota_dl_state *state) {
+    struct ota_flash_session fs;
+
+    ota_flash_session_begin(&fs);
+    int rc = __ota_dl_commit(state);
+    ota_flash_session_end(&fs);
+
+    return rc;
+}
@@ -73,6 +73,20 @@
 #define FLASH_NOTA_LEN			0xd000
 #define FLASH_OTA_LEN			0x2000
 #define FLASH_OTA_BASE			FLASH_APP_BASE + FLASH_NOTA_LEN
+#define FLASH_OTA_ZONE_LEN		(FLASH_OTA_LEN / 2)
+/* Each zone ends in its metadata, OTA_METADATA_SIZE in Include/ota.h, which */
+/* ota.c checks against the struct; extract_ota.py uses the same payload.    */
+#define FLASH_OTA_METADATA_LEN		196
+#define FLASH_OTA_PAYLOAD_LEN		(FLASH_OTA_ZONE_LEN - FLASH_OTA_METADATA_LEN)
+
+/* A/B execute-in-place images (OTA_BOOT_XIP) are linked once per zone;     */
+/* linker_wrapper.sh relinks with --define=OTA_LINK_SLOT=1 for the 2nd zone. */
+/* Either slot links into the payload only, never over the zone metadata.    */
+#ifndef OTA_LINK_SLOT
+#define OTA_LINK_SLOT			0
+#endif
+#define FLASH_OTA_LINK_BASE		(FLASH_OTA_BASE + OTA_LINK_SLOT * FLASH_OTA_ZONE_LEN)
+#define FLASH_OTA_LINK_LEN		FLASH_OTA_PAYLOAD_LEN
 #define FLASH_LEN               0x20000
 #define FLASH_PAGE_LEN          0x1000
 
@@ -116,7 +130,7 @@ MEMORY
     FLASH_NOTA (RX) : origin = FLASH_APP_BASE, length = FLASH_NOTA_LEN - FLASH_PAGE_LEN
     // CCFG Page, contains .ccfg code section and some application code.
     FLASH_NOTA_LAST_PAGE (RX) :  origin = FLASH_NOTA_LAST_PAGE_START, length = FLASH_PAGE_LEN
-    FLASH_OTA (RX) : origin = FLASH_OTA_BASE, length = FLASH_OTA_LEN
+    FLASH_OTA (RX) : origin = FLASH_OTA_LINK_BASE, length = FLASH_OTA_LINK_LEN
 
 
     /* Application uses internal RAM for data */
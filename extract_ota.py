@@ -8,12 +8,23 @@ import re
 
 from elftools.elf import elffile
 
+import ota_container
+
 mswindows = (sys.platform == "win32")
 
 FLASH_OTA_BASE=0xd000
 FLASH_OTA_MAX_LEN=0x2000
 SRAM_OTA_BASE=0x20000000
 SRAM_OTA_MAX_LEN=0x1000
+OTA_ZONE_SIZE=FLASH_OTA_MAX_LEN // 2
+# What a sector erase leaves; the board does not program runs of it
+FLASH_ERASED=b'\xff'
+# Include/ota.h: a load of this offset zero-fills its dest
+OTA_LOAD_ZERO_FILL=ota_container.OTA_LOAD_ZERO_FILL
+OTA_LOAD_TABLE=ota_container.OTA_LOAD_TABLE
+OTA_LOAD_TASK=ota_container.OTA_LOAD_TASK
+# A load table entry costs 8 bytes; shorter zero runs stay in the payload
+ZERO_FILL_MIN=16
 
 class LinkerEntry(object):
     def __init__(self, object_file, section, bytes_=None):
@@ -77,6 +88,17 @@ def _find_entrypoint(obj):
         "Could not find entrypoint symbol {0}".format(entrypoint)
     )
 
+def _find_task(obj):
+    """Returns (stack size, priority) of DEFINE_TASK(), or None."""
+    symtab_name = '.symtab' if mswindows else b'.symtab'
+    symtab = obj.get_section_by_name(symtab_name)
+    for sym in symtab.iter_symbols():
+        decname = sym.name if mswindows else sym.name.decode('utf8')
+        m = re.match(r'^__ota_task_(\d+)_(\d+)$', decname)
+        if m:
+            return int(m.group(1)), int(m.group(2))
+    return None
+
 def filter_segments(elf, segments):
     """Filters out segments that don't correspond to .ota sections.
 
@@ -127,6 +149,7 @@ def extract_ota_code(params, binary_path):
         )
         segments = filter_segments(obj, segments)
         entrypoint = _find_entrypoint(obj) - params.ota_flash_addr
+        task = _find_task(obj)
 
         #data = b''
         data = bytearray()
@@ -135,8 +158,9 @@ def extract_ota_code(params, binary_path):
 
         for seg in sorted(segments, key=lambda x: x.header.p_vaddr):
             if seg_in_ota_flash(seg):
+                # Alignment padding is never read, so it can stay erased
                 skip = seg.header.p_vaddr - data_offset
-                data += (b'\x00' * skip)
+                data += (FLASH_ERASED * skip)
                 data_offset += skip
                 seg_data = seg.data()
                 data += seg_data
@@ -154,7 +178,7 @@ def extract_ota_code(params, binary_path):
                 data += seg_data
                 data_offset += seg.header.p_memsz
 
-    return loads, entrypoint, data
+    return loads, entrypoint, task, data
 
 def extract_ota_data(binary_path, entries):
     with open(binary_path, 'rb') as f:
@@ -164,7 +188,10 @@ def extract_ota_data(binary_path, entries):
                 continue
 
             sect = elf.get_section_by_name(entry.section)
-            if sect:
+            if sect and sect['sh_type'] == 'SHT_NOBITS':
+                # .bss-like: zeros, not stored in the object file
+                entry.bytes = bytes(sect['sh_size'])
+            elif sect:
                 entry.bytes = sect.data()
 
 def create_entries(text_entries):
@@ -175,7 +202,7 @@ def create_entries(text_entries):
         entry = re.sub(r'\s+', ' ', text_entry.strip()).split(' ')
         size = int(entry[1], 16)
         if entry[-1] == '--HOLE--':
-            entries.append(LinkerEntry(None, None, b'0' * size))
+            entries.append(LinkerEntry(None, None, bytes(size)))
         else:
             object_file = entry[2]
             section = entry[3].strip('()')
@@ -211,22 +238,86 @@ def verify_resolved_entries(entries):
         raise RuntimeError(msg)
 
 def patch_data(loads, entries, data):
-    assert len(loads) == 1, "we should have only one .ota.data entry."
-
-    initial_offset = loads[0]['offset']
-    offset = initial_offset
-    len_ = loads[0]['len']
+    """Fills the loads, in address order, with the .ota.data entries."""
     for entry in entries:
         assert entry.is_resolved(), ("by this time all entries should've been read."
                                      "shame on you.")
-        data[offset:offset + len(entry.bytes)] = entry.bytes
-        offset += len(entry.bytes)
+    blob = b''.join(entry.bytes for entry in entries)
 
-    if initial_offset + len_ != offset:
+    if sum(load['len'] for load in loads) != len(blob):
         raise RuntimeError('not all data bytes were patched.')
 
+    pos = 0
+    for load in sorted(loads, key=lambda l: l['dest']):
+        offset, len_ = load['offset'], load['len']
+        data[offset:offset + len_] = blob[pos:pos + len_]
+        pos += len_
+
     return data
 
+def _zero_runs(data, start, end):
+    """Yields (start, end) of the runs of zeros in data[start:end]."""
+    i = start
+    while i < end:
+        if data[i]:
+            i += 1
+            continue
+        j = i
+        while j < end and not data[j]:
+            j += 1
+        yield i, j
+        i = j
+
+def _pad_words(data):
+    data += FLASH_ERASED * (-len(data) % 4)
+    return data
+
+def layout_loads(loads, data, room=ota_container.OTA_MAX_LOADS):
+    """Packs the loads at the end of the payload.
+
+    Runs of ZERO_FILL_MIN or more zeros become OTA_LOAD_ZERO_FILL loads, and
+    the rest of each load is appended after the code with nothing in between.
+    Where the linker put the load images is left erased, and cut off when it
+    ends the payload. More loads than the image header has room for go in
+    a load table after them, which the header points at with one
+    OTA_LOAD_TABLE load.
+    """
+    pieces = []
+    for load in loads:
+        start, end = load['offset'], load['offset'] + load['len']
+        s = start
+        for i, j in _zero_runs(data, start, end):
+            if j - i < ZERO_FILL_MIN:
+                continue
+            if i > s:
+                pieces.append((load['dest'] + s - start, bytes(data[s:i])))
+            pieces.append((load['dest'] + i - start, j - i))
+            s = j
+        if end > s:
+            pieces.append((load['dest'] + s - start, bytes(data[s:end])))
+        data[start:end] = FLASH_ERASED * (end - start)
+
+    # Erased flash past the payload reads back the same
+    end = len(data)
+    while end and data[end - 1:end] == FLASH_ERASED:
+        end -= 1
+    data = _pad_words(data[:end])
+
+    res = []
+    for dest, piece in pieces:
+        if isinstance(piece, int):
+            res.append({'dest': dest, 'offset': OTA_LOAD_ZERO_FILL, 'len': piece})
+            continue
+        res.append({'dest': dest, 'offset': len(data), 'len': len(piece)})
+        data += piece
+    data = _pad_words(data)
+
+    if len(res) > room:
+        table = {'dest': OTA_LOAD_TABLE, 'offset': len(data), 'len': len(res)}
+        data += ota_container.pack_loads(res)
+        res = [table]
+    return res, data
+
 def extract_ota(params):
     """Extracts data and meta-data information from the ELF.
 
@@ -234,10 +325,15 @@ def extract_ota(params):
     dictionary with the following kv pairs:
         size       - total size of the blob
         loads      - one or more chunks from .ota.data
-                     (offset = offset for payload within the `data` blob
+                     (offset = offset for payload within the `data` blob,
+                      or OTA_LOAD_ZERO_FILL for zeros that are not in it
                       len = #of bytes in memory for the segment,
-                      dest = load base address)
+                      dest = load base address, or OTA_LOAD_TABLE for the
+                      table of len more loads at offset, or OTA_LOAD_TASK
+                      for the DEFINE_TASK() priority in offset and stack
+                      size in len)
         entrypoint - offset of entrypoint (relative to flash base)
+        slot       - OTA zone the image was linked for
         data       - blob of code + data
 
     """
@@ -252,18 +348,30 @@ def extract_ota(params):
 
     for binary_path in binary_paths:
         if binary_path.endswith('.out'):
-            loads, entrypoint, data = extract_ota_code(params, binary_path)
+            loads, entrypoint, task, data = extract_ota_code(params, binary_path)
         else:
             assert binary_path.endswith('.obj'), 'r u insane?'
             extract_ota_data(binary_path, entries)
 
     verify_resolved_entries(entries)
     data = patch_data(loads, entries, data)
+    if task is None:
+        loads, data = layout_loads(loads, data)
+    else:
+        # The task load is only read from the image header
+        loads, data = layout_loads(loads, data, ota_container.OTA_MAX_LOADS - 1)
+        loads.append({'dest': OTA_LOAD_TASK, 'offset': task[1], 'len': task[0]})
+
+    # The board refuses anything larger in ota_dl_begin()
+    if len(data) > ota_container.OTA_PAYLOAD_SIZE:
+        raise RuntimeError('OTA payload is {0} bytes, a zone holds {1}'.format(
+            len(data), ota_container.OTA_PAYLOAD_SIZE))
 
     return {
         'size': len(data),
         'loads': loads,
         'entrypoint': entrypoint,
+        'slot': params.ota_slot,
         'data': data,
     }
 
@@ -304,12 +412,35 @@ def parse_args():
         help='Max length of OTA app in the SRAM',
         required=False,
     )
+    parser.add_argument(
+        '--ota-slot',
+        type=int,
+        default=0,
+        choices=(0, 1),
+        help='OTA zone the image was linked for (A/B execute-in-place)',
+        required=False,
+    )
+    parser.add_argument(
+        '--container',
+        type=str,
+        default=None,
+        help='Also write the image as a binary OTA container to this path',
+        required=False,
+    )
     opts = parser.parse_args()
+    if opts.ota_slot:
+        # Extract relative to the zone the image runs from.
+        opts.ota_flash_addr += opts.ota_slot * OTA_ZONE_SIZE
+        opts.ota_flash_len = OTA_ZONE_SIZE
     return opts
 
 def main():
     opts = parse_args()
     res = extract_ota(opts)
+    if opts.container:
+        with open(opts.container, 'wb') as f:
+            f.write(ota_container.pack(res['entrypoint'], res['slot'],
+                                       res['loads'], bytes(res['data'])))
     res['data'] = ''.join(
         (
             '{0:02x}'.format(b) for b in res['data']
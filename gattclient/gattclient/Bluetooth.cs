@@ -17,13 +17,14 @@ using System.Runtime.InteropServices;
 namespace gattclient
 {
     
+    // Version 2 chunk header (OTA_BLOB_MAGIC_V2)
     [StructLayout(LayoutKind.Sequential, Pack=1)]
     struct OTABlob
     {
         public uint magic;
-        public ushort total_size;
-        public byte cur_chunk;
-        public byte num_chunks;
+        public uint total_size;
+        public ushort cur_chunk;
+        public ushort num_chunks;
         public ushort checksum;
         public ushort chunk_len;
         /* uint8_t blob[0]; */
@@ -44,6 +45,34 @@ namespace gattclient
         }
     };
 
+    // Window ack notified by the device: every chunk below base_chunk has
+    // arrived, bit i of bitmap means chunk base_chunk + 1 + i has too.
+    [StructLayout(LayoutKind.Sequential, Pack=1)]
+    struct OTAAck
+    {
+        public ushort base_chunk;
+        public byte bitmap;
+        public byte status;
+
+        public static OTAAck FromBytes(byte[] bytes)
+        {
+            OTAAck ack = new OTAAck();
+            ack.base_chunk = BitConverter.ToUInt16(bytes, 0);
+            ack.bitmap = bytes[2];
+            ack.status = bytes[3];
+            return ack;
+        }
+
+        public bool Has(uint chunk)
+        {
+            if (chunk < base_chunk)
+                return true;
+            if (chunk == base_chunk || chunk - base_chunk > 8)
+                return false;
+            return (bitmap & (1 << (int)(chunk - base_chunk - 1))) != 0;
+        }
+    };
+
     class Bluetooth
     {
         private ObservableCollection<BluetoothLEDeviceDisplay> KnownDevices = new ObservableCollection<BluetoothLEDeviceDisplay>();
@@ -54,6 +83,9 @@ namespace gattclient
 
         private const int READ_CHARACTERISTIC_INDEX = 2;
         private const int WRITE_CHARACTERISTIC_INDEX = 2;
+        private const int ACK_CHARACTERISTIC_INDEX = 5;
+        private const int CAPS_CHARACTERISTIC_INDEX = 6;
+        private const int ACK_TIMEOUT_MS = 2000;
 
         private const int MAX_PAIR_ATTEMPTS = 10;
         private const int MAX_CONNECT_ATTEMPTS = 10;
@@ -393,6 +425,9 @@ namespace gattclient
         private GattCharacteristic selectedCharacteristic;
         private GattPresentationFormat presentationFormat;
 
+        private SemaphoreSlim ackReceived = new SemaphoreSlim(0);
+        private OTAAck lastAck;
+
         private bool ClearBluetoothLEDeviceAsync()
         {
             bluetoothLeDevice?.Dispose();
@@ -524,18 +559,20 @@ namespace gattclient
         #endregion
 
         #region Bytes
-        private async Task<bool> WriteBufferToSelectedCharacteristicAsync(IBuffer buffer)
+        private async Task<bool> WriteBufferToSelectedCharacteristicAsync(IBuffer buffer,
+            GattWriteOption option = GattWriteOption.WriteWithResponse)
         {
             try
             {
                 // BT_Code: Writes the value from the buffer to the characteristic.
-                var result = await selectedCharacteristic.WriteValueWithResultAsync(buffer);
+                var result = await selectedCharacteristic.WriteValueWithResultAsync(buffer, option);
 
                 if (result.Status == GattCommunicationStatus.Success)
                 {
                     Console.WriteLine("Successfully wrote value to device");
 
-                    if (delayAfterSend != 0)
+                    // Windowed writes are paced by the device acks instead
+                    if (delayAfterSend != 0 && option == GattWriteOption.WriteWithResponse)
                     {
                         Console.WriteLine($"Sleeping for {delayAfterSend / 1000} seconds...");
                         Thread.Sleep(delayAfterSend);
@@ -580,28 +617,69 @@ namespace gattclient
         }
 
 
-        private async Task<bool> SendByteInChunks(byte[] data)
+        // Largest chunk payload the device takes over the negotiated MTU,
+        // or the fixed default if it cannot tell us
+        private async Task<uint> ReadChunkPayloadSize()
         {
-            Debug.Assert(CharacteristicCollection.Count > WRITE_CHARACTERISTIC_INDEX &&
-                         CharacteristicCollection[WRITE_CHARACTERISTIC_INDEX].Name == "65523");
+            if (CharacteristicCollection.Count <= CAPS_CHARACTERISTIC_INDEX ||
+                CharacteristicCollection[CAPS_CHARACTERISTIC_INDEX].Name != "65527")
+            {
+                return Constants.OTA_CHUNK_MTU;
+            }
 
-            selectedCharacteristic = CharacteristicCollection[WRITE_CHARACTERISTIC_INDEX].characteristic;
+            try
+            {
+                var caps = CharacteristicCollection[CAPS_CHARACTERISTIC_INDEX].characteristic;
+                GattReadResult result = await caps.ReadValueAsync(BluetoothCacheMode.Uncached);
+                if (result.Status == GattCommunicationStatus.Success)
+                {
+                    byte[] bytes;
+                    CryptographicBuffer.CopyToByteArray(result.Value, out bytes);
+                    uint max_chunk = BitConverter.ToUInt16(bytes, 0);
+                    Console.WriteLine($"Device takes {max_chunk} bytes per chunk.");
+                    if (max_chunk > 0)
+                    {
+                        return max_chunk;
+                    }
+                }
+            }
+            catch (Exception ex)
+            {
+                Console.WriteLine(ex.Message);
+            }
+            return Constants.OTA_CHUNK_MTU;
+        }
+
+        // The image header and payload followed by the CRC32 of the payload,
+        // little-endian, as ota_container.pack_stream() lays it out
+        private byte[] AppendCrcTrailer(byte[] data)
+        {
+            uint crc = Utilities.Crc32(data, Math.Min(Constants.OTA_IMAGE_HEADER_SIZE, data.Length));
+            byte[] stream = new byte[data.Length + sizeof(uint)];
+
+            data.CopyTo(stream, 0);
+            BitConverter.GetBytes(crc).CopyTo(stream, data.Length);
+            return stream;
+        }
 
-            uint num_chunks = (uint)Math.Ceiling(((float)data.Length / Constants.OTA_CHUNK_MTU));
+        private byte[][] BuildChunks(byte[] data, uint chunk_payload)
+        {
+            uint num_chunks = (uint)Math.Ceiling(((float)data.Length / chunk_payload));
+            byte[][] chunks = new byte[num_chunks][];
             uint offset = 0;
 
             OTABlob blob = new OTABlob();
-            blob.magic = Constants.OTA_BLOB_MAGIC;
-            blob.total_size = (ushort)data.Length;
-            blob.num_chunks = (byte)num_chunks;
+            blob.magic = Constants.OTA_BLOB_MAGIC_V2;
+            blob.total_size = (uint)data.Length;
+            blob.num_chunks = (ushort)num_chunks;
             blob.checksum = 0;
             blob.cur_chunk = 0;
 
             for (uint chunk = 0; chunk < num_chunks; chunk++)
             {
-                uint data_len = Math.Min(Constants.OTA_CHUNK_MTU, (uint)data.Length - offset);
+                uint data_len = Math.Min(chunk_payload, (uint)data.Length - offset);
                 int struct_size = System.Runtime.InteropServices.Marshal.SizeOf(blob);
-                Debug.Assert(struct_size == 12);
+                Debug.Assert(struct_size == 16);
 
                 byte[] bytes = new byte[struct_size + data_len];
 
@@ -613,21 +691,149 @@ namespace gattclient
                 //data.CopyTo(bytes, struct_size);
 
                 System.Buffer.BlockCopy(data, (int)offset, bytes, struct_size, (int)data_len);
+                chunks[chunk] = bytes;
+
+                offset += data_len;
+                blob.cur_chunk++;
+            }
+
+            return chunks;
+        }
 
-                var writeBuffer = CryptographicBuffer.CreateFromByteArray(bytes);
-                // TODO: add dump buffer to console
-                Console.WriteLine($"Chunk {chunk + 1}/{num_chunks} Writing {data_len} bytes to device.");
-                var writeSuccessful = await WriteBufferToSelectedCharacteristicAsync(writeBuffer);
-                if (!writeSuccessful)
+        private void AckCharacteristic_ValueChanged(GattCharacteristic sender, GattValueChangedEventArgs args)
+        {
+            byte[] bytes;
+            CryptographicBuffer.CopyToByteArray(args.CharacteristicValue, out bytes);
+            lock (this)
+            {
+                lastAck = OTAAck.FromBytes(bytes);
+            }
+            ackReceived.Release();
+        }
+
+        private async Task<OTAAck?> WaitForAck(GattCharacteristic ackCharacteristic)
+        {
+            if (await ackReceived.WaitAsync(ACK_TIMEOUT_MS))
+            {
+                // Only the latest ack matters
+                while (ackReceived.Wait(0))
                 {
-                    return false;
                 }
+                lock (this)
+                {
+                    return lastAck;
+                }
+            }
 
-                offset += data_len;
-                blob.cur_chunk++;
+            // The notification may have been dropped, poll the ack instead
+            try
+            {
+                GattReadResult result = await ackCharacteristic.ReadValueAsync(BluetoothCacheMode.Uncached);
+                if (result.Status == GattCommunicationStatus.Success)
+                {
+                    byte[] bytes;
+                    CryptographicBuffer.CopyToByteArray(result.Value, out bytes);
+                    return OTAAck.FromBytes(bytes);
+                }
+                Console.WriteLine($"Ack read failed: {result.Status}");
+            }
+            catch (Exception ex)
+            {
+                Console.WriteLine(ex.Message);
             }
+            return null;
+        }
 
-            return true;
+        private async Task<bool> SendByteInChunks(byte[] data)
+        {
+            Debug.Assert(CharacteristicCollection.Count > ACK_CHARACTERISTIC_INDEX &&
+                         CharacteristicCollection[WRITE_CHARACTERISTIC_INDEX].Name == "65523" &&
+                         CharacteristicCollection[ACK_CHARACTERISTIC_INDEX].Name == "65526");
+
+            selectedCharacteristic = CharacteristicCollection[WRITE_CHARACTERISTIC_INDEX].characteristic;
+            GattCharacteristic ackCharacteristic = CharacteristicCollection[ACK_CHARACTERISTIC_INDEX].characteristic;
+
+            ackCharacteristic.ValueChanged += AckCharacteristic_ValueChanged;
+            try
+            {
+                var cccd = await ackCharacteristic.WriteClientCharacteristicConfigurationDescriptorAsync(
+                    GattClientCharacteristicConfigurationDescriptorValue.Notify);
+                if (cccd != GattCommunicationStatus.Success)
+                {
+                    Console.WriteLine($"Enabling ack notifications failed: {cccd}");
+                    return false;
+                }
+
+                byte[][] chunks = BuildChunks(AppendCrcTrailer(data), await ReadChunkPayloadSize());
+                uint num_chunks = (uint)chunks.Length;
+                OTAAck ack = new OTAAck();
+                int stalls = 0;
+
+                // Send what is missing from the current window without
+                // waiting for write responses, then let the device ack.
+                // Windows are aligned so the device acks as the last
+                // chunk of each one lands.
+                while (ack.base_chunk < num_chunks && ack.status != Constants.OTA_ACK_DONE)
+                {
+                    uint end = Math.Min((ack.base_chunk / Constants.OTA_WINDOW + 1) * Constants.OTA_WINDOW,
+                                        num_chunks);
+                    for (uint chunk = ack.base_chunk; chunk < end; chunk++)
+                    {
+                        if (ack.Has(chunk))
+                        {
+                            continue;
+                        }
+                        var writeBuffer = CryptographicBuffer.CreateFromByteArray(chunks[chunk]);
+                        Console.WriteLine($"Chunk {chunk + 1}/{num_chunks} Writing {chunks[chunk].Length} bytes to device.");
+                        var writeSuccessful = await WriteBufferToSelectedCharacteristicAsync(writeBuffer,
+                            GattWriteOption.WriteWithoutResponse);
+                        if (!writeSuccessful)
+                        {
+                            return false;
+                        }
+                    }
+
+                    OTAAck? next = await WaitForAck(ackCharacteristic);
+                    if (next == null)
+                    {
+                        // The device resets once the image is committed if it
+                        // cannot swap to it, so silence after the last window
+                        // means success
+                        if (end == num_chunks)
+                        {
+                            Console.WriteLine("No ack after the last window, assuming the device rebooted.");
+                            return true;
+                        }
+                        return false;
+                    }
+
+                    if (next.Value.status == Constants.OTA_ACK_ERROR)
+                    {
+                        Console.WriteLine($"The device dropped the transfer at chunk {next.Value.base_chunk}.");
+                        return false;
+                    }
+
+                    if (next.Value.base_chunk == ack.base_chunk && next.Value.bitmap == ack.bitmap)
+                    {
+                        if (++stalls >= MAX_SEND_ATTEMPTS)
+                        {
+                            Console.WriteLine($"No progress past chunk {ack.base_chunk}, giving up.");
+                            return false;
+                        }
+                    }
+                    else
+                    {
+                        stalls = 0;
+                    }
+                    ack = next.Value;
+                }
+
+                return true;
+            }
+            finally
+            {
+                ackCharacteristic.ValueChanged -= AckCharacteristic_ValueChanged;
+            }
         }
 
         private async Task SendByteFull(byte[] data)
@@ -8,7 +8,13 @@ namespace gattclient
 {
     class Constants
     {
-        internal const uint OTA_CHUNK_MTU = 68;
+        internal const uint OTA_CHUNK_MTU = 64;
         internal const uint OTA_BLOB_MAGIC = 0xdabad000;
+        internal const uint OTA_BLOB_MAGIC_V2 = 0xdabad002;
+        internal const uint OTA_WINDOW = 8;
+        internal const byte OTA_ACK_DONE = 1;
+        internal const byte OTA_ACK_ERROR = 2;
+        // struct OTAHeader: entrypoint, size and the load table
+        internal const int OTA_IMAGE_HEADER_SIZE = 28;
     }
 }
@@ -38,5 +38,26 @@ namespace gattclient
             }
             return data;
         }
+
+        /// <summary>
+        ///     CRC32 as zlib computes it (reflected polynomial 0xEDB88320), the one the device checks
+        ///     an image against before committing it
+        /// </summary>
+        /// <param name="data">Buffer to run the CRC over</param>
+        /// <param name="offset">First byte of the run</param>
+        /// <returns></returns>
+        public static uint Crc32(byte[] data, int offset)
+        {
+            uint crc = 0xffffffff;
+            for (int i = offset; i < data.Length; i++)
+            {
+                crc ^= data[i];
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    crc = (crc & 1) != 0 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+                }
+            }
+            return ~crc;
+        }
     }
 }
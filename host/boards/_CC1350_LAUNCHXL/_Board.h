@@ -0,0 +1,6 @@
+/*
+ * Empty stand-in for the CC1350 LaunchPad board header.
+ */
+#ifndef __BOARD_H
+#define __BOARD_H
+#endif // __BOARD_H
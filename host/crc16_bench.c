@@ -0,0 +1,121 @@
+/*
+ * Checks the table-driven CRC-16 kernel in PROFILES/oad_crc.h against the
+ * bitwise crc16() that oad.c used before, and times both.
+ *
+ * crcCalcDL() used to run crc16() over each byte and then over two zero
+ * bytes; oadCrc16Update() must produce the same value for every input.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <PROFILES/oad_crc.h>
+
+/* 4 KiB pages, 4-byte flash words, as in hal_flash.h for the CC13xx */
+#define PAGE_SIZE       4096
+#define WORD_SIZE       4
+#define READ_BURST      128
+
+#define IMAGE_SIZE      (128 * 1024)
+#define ROUNDS          20
+
+/* The previous oad.c implementation, verbatim. */
+static uint16_t crc16(uint16_t crc, uint8_t val)
+{
+  const uint16_t poly = 0x1021;
+  uint8_t cnt;
+
+  for (cnt = 0; cnt < 8; cnt++, val <<= 1)
+  {
+    uint8_t msb = (crc & 0x8000) ? 1 : 0;
+
+    crc <<= 1;
+
+    if (val & 0x80)
+    {
+      crc |= 0x0001;
+    }
+
+    if (msb)
+    {
+      crc ^= poly;
+    }
+  }
+
+  return crc;
+}
+
+static uint16_t crc_bitwise(const uint8_t *buf, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++)
+        crc = crc16(crc, buf[i]);
+    crc = crc16(crc, 0);
+    return crc16(crc, 0);
+}
+
+/* crcCalcDL's loop shape: one kernel call per read burst. */
+static uint16_t crc_table(const uint8_t *buf, size_t len) {
+    uint16_t crc = 0;
+    while (len) {
+        uint16_t n = len > READ_BURST ? READ_BURST : len;
+        crc = oadCrc16Update(crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+    return crc;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    static uint8_t image[IMAGE_SIZE];
+    uint32_t seed = 1;
+    int failures = 0;
+
+    for (size_t i = 0; i < IMAGE_SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = seed >> 16;
+    }
+
+    /* Every length up to a few bursts, at every alignment within a word. */
+    for (size_t off = 0; off < WORD_SIZE; off++) {
+        for (size_t len = 0; len <= 3 * READ_BURST + 7; len++) {
+            if (crc_bitwise(&image[off], len) != crc_table(&image[off], len)) {
+                fprintf(stderr, "mismatch at offset %zu, length %zu\n",
+                        off, len);
+                failures++;
+            }
+        }
+    }
+
+    uint16_t ref = crc_bitwise(image, IMAGE_SIZE);
+    if (ref != crc_table(image, IMAGE_SIZE)) {
+        fprintf(stderr, "mismatch over the full image\n");
+        failures++;
+    }
+
+    volatile uint16_t sink = 0;
+    double t0 = now_s();
+    for (int r = 0; r < ROUNDS; r++)
+        sink ^= crc_bitwise(image, IMAGE_SIZE);
+    double t_bit = (now_s() - t0) / ROUNDS;
+
+    t0 = now_s();
+    for (int r = 0; r < ROUNDS; r++)
+        sink ^= crc_table(image, IMAGE_SIZE);
+    double t_tab = (now_s() - t0) / ROUNDS;
+
+    printf("crc16 over %d KiB: bitwise %.1f ns/B, table %.1f ns/B (%.1fx)\n",
+           IMAGE_SIZE / 1024, t_bit * 1e9 / IMAGE_SIZE,
+           t_tab * 1e9 / IMAGE_SIZE, t_bit / t_tab);
+    printf("OADTarget_readFlash calls per page: %d -> %d\n",
+           PAGE_SIZE / WORD_SIZE, PAGE_SIZE / READ_BURST);
+    printf("%s\n", failures ? "FAIL" : "PASS");
+
+    return failures ? 1 : 0;
+}
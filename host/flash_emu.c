@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <driverlib/flash.h>
+#include <driverlib/vims.h>
+#include <driverlib/sys_ctrl.h>
+#include <ti/sysbios/hal/Hwi.h>
+#include <ti/sysbios/knl/Clock.h>
+#include <ti/sysbios/knl/Task.h>
+#include <xdc/runtime/Timestamp.h>
+
+#include "flash_emu.h"
+
+/*
+ * The mapping is executable so ota_bench can boot a stub entrypoint in place.
+ *
+ * Defaults follow the CC1350 datasheet: 8 us per 32-bit word program and
+ * 8 ms per 4 KiB sector erase. The cache toggle cost is a rough estimate of
+ * the VIMS flush plus the refill misses that follow it.
+ */
+struct flash_emu_timing flash_emu_timing = {
+    .program_byte_ns = 2000,
+    .program_call_ns = 10000,
+    .erase_sector_ns = 8000000,
+    .cache_toggle_ns = 2000,
+};
+
+struct flash_emu_stats flash_emu_stats;
+
+static uint8_t *flash_mem;
+static uint8_t sector_protected[FLASH_EMU_NR_SECTORS];
+static uint32_t vims_mode = VIMS_MODE_ENABLED;
+static int hwi_enabled = 1;
+static uint64_t hwi_masked_since;
+
+int flash_emu_init(void) {
+    void *p = mmap((void *) FLASH_EMU_BASE, FLASH_EMU_SIZE,
+                   PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (p == MAP_FAILED || p != (void *) FLASH_EMU_BASE) {
+        perror("flash_emu: mmap");
+        return -1;
+    }
+    flash_mem = p;
+    flash_emu_erase_all();
+    flash_emu_reset();
+    flash_emu_stats_reset();
+    return 0;
+}
+
+void flash_emu_erase_all(void) {
+    memset(flash_mem, 0xff, FLASH_EMU_SIZE);
+}
+
+/* Equivalent of a system reset: protection bits and VIMS/HWI state clear. */
+void flash_emu_reset(void) {
+    memset(sector_protected, 0, sizeof (sector_protected));
+    vims_mode = VIMS_MODE_ENABLED;
+    hwi_enabled = 1;
+}
+
+void flash_emu_stats_reset(void) {
+    memset(&flash_emu_stats, 0, sizeof (flash_emu_stats));
+}
+
+void flash_emu_advance(uint64_t ns) {
+    flash_emu_stats.now_ns += ns;
+}
+
+uint8_t *flash_emu_ptr(uint32_t addr) {
+    return flash_mem + (addr - FLASH_EMU_BASE);
+}
+
+static int in_flash(uint32_t addr, uint32_t len) {
+    return addr >= FLASH_EMU_BASE &&
+           len <= FLASH_EMU_SIZE &&
+           addr - FLASH_EMU_BASE <= FLASH_EMU_SIZE - len;
+}
+
+static uint32_t sector_of(uint32_t addr) {
+    return (addr - FLASH_EMU_BASE) / FLASH_EMU_SECTOR_SIZE;
+}
+
+static void flash_busy(uint64_t ns) {
+    if (vims_mode != VIMS_MODE_OFF || hwi_enabled)
+        flash_emu_stats.unsafe_ops++;
+    flash_emu_stats.flash_busy_ns += ns;
+    flash_emu_advance(ns);
+}
+
+uint32_t FlashSectorSizeGet(void) {
+    return FLASH_EMU_SECTOR_SIZE;
+}
+
+uint32_t FlashSizeGet(void) {
+    return FLASH_EMU_SIZE;
+}
+
+uint32_t FlashSectorErase(uint32_t ui32SectorAddress) {
+    if (!in_flash(ui32SectorAddress, FLASH_EMU_SECTOR_SIZE) ||
+        (ui32SectorAddress - FLASH_EMU_BASE) % FLASH_EMU_SECTOR_SIZE ||
+        sector_protected[sector_of(ui32SectorAddress)]) {
+        flash_emu_stats.rejected_ops++;
+        return FAPI_STATUS_FSM_ERROR;
+    }
+
+    flash_busy(flash_emu_timing.erase_sector_ns);
+    memset(flash_emu_ptr(ui32SectorAddress), 0xff, FLASH_EMU_SECTOR_SIZE);
+    flash_emu_stats.erases++;
+    return FAPI_STATUS_SUCCESS;
+}
+
+uint32_t FlashProgram(uint8_t *pui8DataBuffer, uint32_t ui32Address,
+                      uint32_t ui32Count) {
+    if (!in_flash(ui32Address, ui32Count)) {
+        flash_emu_stats.rejected_ops++;
+        return FAPI_STATUS_INCORRECT_DATABUFFER_LENGTH;
+    }
+    for (uint32_t s = sector_of(ui32Address);
+         ui32Count && s <= sector_of(ui32Address + ui32Count - 1); s++) {
+        if (sector_protected[s]) {
+            flash_emu_stats.rejected_ops++;
+            return FAPI_STATUS_FSM_ERROR;
+        }
+    }
+
+    flash_busy(flash_emu_timing.program_call_ns +
+               flash_emu_timing.program_byte_ns * ui32Count);
+
+    /* NOR semantics: programming can only clear bits. */
+    uint8_t *dst = flash_emu_ptr(ui32Address);
+    for (uint32_t i = 0; i < ui32Count; i++)
+        dst[i] &= pui8DataBuffer[i];
+
+    flash_emu_stats.program_calls++;
+    flash_emu_stats.bytes_programmed += ui32Count;
+    return FAPI_STATUS_SUCCESS;
+}
+
+/* Like the real part, write protection can only be lifted by a reset. */
+void FlashProtectionSet(uint32_t ui32SectorAddress, uint32_t ui32ProtectMode) {
+    if (!in_flash(ui32SectorAddress, 1))
+        return;
+    if (ui32ProtectMode == FLASH_WRITE_PROTECT)
+        sector_protected[sector_of(ui32SectorAddress)] = 1;
+}
+
+uint32_t FlashProtectionGet(uint32_t ui32SectorAddress) {
+    if (!in_flash(ui32SectorAddress, 1))
+        return FLASH_NO_PROTECT;
+    return sector_protected[sector_of(ui32SectorAddress)] ?
+            FLASH_WRITE_PROTECT : FLASH_NO_PROTECT;
+}
+
+void VIMSModeSet(uint32_t ui32Base, uint32_t ui32Mode) {
+    (void) ui32Base;
+    if (ui32Mode == vims_mode)
+        return;
+    vims_mode = ui32Mode;
+    flash_emu_stats.cache_toggles++;
+    flash_emu_advance(flash_emu_timing.cache_toggle_ns);
+}
+
+uint32_t VIMSModeGet(uint32_t ui32Base) {
+    (void) ui32Base;
+    return vims_mode;
+}
+
+void VIMSLineBufDisable(uint32_t ui32Base) {
+    (void) ui32Base;
+}
+
+void VIMSLineBufEnable(uint32_t ui32Base) {
+    (void) ui32Base;
+}
+
+UInt Hwi_disable(void) {
+    UInt key = hwi_enabled;
+    if (hwi_enabled) {
+        hwi_enabled = 0;
+        hwi_masked_since = flash_emu_stats.now_ns;
+        flash_emu_stats.hwi_disables++;
+    }
+    return key;
+}
+
+void Hwi_restore(UInt key) {
+    if (key && !hwi_enabled) {
+        uint64_t masked = flash_emu_stats.now_ns - hwi_masked_since;
+        hwi_enabled = 1;
+        flash_emu_stats.hwi_masked_ns += masked;
+        if (masked > flash_emu_stats.hwi_masked_max_ns)
+            flash_emu_stats.hwi_masked_max_ns = masked;
+    }
+}
+
+void SysCtrlSystemReset(void) {
+    flash_emu_stats.resets++;
+    flash_emu_reset();
+}
+
+Bits32 Timestamp_get32(void) {
+    return (Bits32) flash_emu_stats.now_ns;
+}
+
+Task_Struct *Task_emu_last;
+Clock_Struct *Clock_emu_last;
+
+void Task_sleep(UInt32 ticks) {
+    flash_emu_advance((uint64_t) ticks * Clock_tickPeriod * 1000);
+    if (Task_emu_last && Task_emu_last->mode == Task_Mode_READY)
+        Task_emu_run(Task_emu_last);
+}
@@ -0,0 +1,54 @@
+#ifndef FLASH_EMU_H
+#define FLASH_EMU_H
+
+#include <stdint.h>
+
+/*
+ * Emulated CC1350F128 internal flash. Device flash address A lives at host
+ * address FLASH_EMU_BASE + A, so the pointer arithmetic Startup/ota.c does on
+ * OTA_REGION keeps working (OTA_FLASH_BASE is shifted by the same amount).
+ */
+#ifndef FLASH_EMU_BASE
+#define FLASH_EMU_BASE          0x10000000
+#endif
+#define FLASH_EMU_SIZE          0x20000
+#define FLASH_EMU_SECTOR_SIZE   0x1000
+#define FLASH_EMU_NR_SECTORS    (FLASH_EMU_SIZE / FLASH_EMU_SECTOR_SIZE)
+
+/* Cost model, all in simulated nanoseconds. */
+struct flash_emu_timing {
+    uint64_t program_byte_ns;   /* per byte handed to FlashProgram */
+    uint64_t program_call_ns;   /* fixed FSM setup cost per FlashProgram */
+    uint64_t erase_sector_ns;   /* per FlashSectorErase */
+    uint64_t cache_toggle_ns;   /* per VIMS mode change (flush/refill) */
+};
+
+struct flash_emu_stats {
+    uint64_t now_ns;
+    uint64_t flash_busy_ns;
+    uint32_t erases;
+    uint32_t program_calls;
+    uint64_t bytes_programmed;
+    uint32_t cache_toggles;
+    uint32_t hwi_disables;
+    uint64_t hwi_masked_ns;
+    uint64_t hwi_masked_max_ns;
+    /* Flash operations issued with the cache on or interrupts enabled. */
+    uint32_t unsafe_ops;
+    /* Operations rejected because of range, alignment or protection. */
+    uint32_t rejected_ops;
+    /* SysCtrlSystemReset() calls */
+    uint32_t resets;
+};
+
+extern struct flash_emu_timing flash_emu_timing;
+extern struct flash_emu_stats flash_emu_stats;
+
+int flash_emu_init(void);
+void flash_emu_erase_all(void);
+void flash_emu_reset(void);
+void flash_emu_stats_reset(void);
+void flash_emu_advance(uint64_t ns);
+uint8_t *flash_emu_ptr(uint32_t addr);
+
+#endif // FLASH_EMU_H
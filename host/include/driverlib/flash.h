@@ -0,0 +1,27 @@
+/*
+ * Host emulation of the subset of driverlib/flash.h used by Startup/ota.c.
+ * Backed by host/flash_emu.c.
+ */
+#ifndef __FLASH_H__
+#define __FLASH_H__
+
+#include <stdint.h>
+
+#define FAPI_STATUS_SUCCESS                     0x00000000
+#define FAPI_STATUS_FSM_BUSY                    0x00000001
+#define FAPI_STATUS_FSM_READY                   0x00000002
+#define FAPI_STATUS_INCORRECT_DATABUFFER_LENGTH 0x00000003
+#define FAPI_STATUS_FSM_ERROR                   0x00000004
+
+#define FLASH_NO_PROTECT        0x00000000
+#define FLASH_WRITE_PROTECT     0x00000001
+
+uint32_t FlashSectorSizeGet(void);
+uint32_t FlashSizeGet(void);
+uint32_t FlashSectorErase(uint32_t ui32SectorAddress);
+uint32_t FlashProgram(uint8_t *pui8DataBuffer, uint32_t ui32Address,
+                      uint32_t ui32Count);
+void FlashProtectionSet(uint32_t ui32SectorAddress, uint32_t ui32ProtectMode);
+uint32_t FlashProtectionGet(uint32_t ui32SectorAddress);
+
+#endif // __FLASH_H__
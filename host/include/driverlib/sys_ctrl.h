@@ -0,0 +1,9 @@
+/*
+ * Host emulation of driverlib/sys_ctrl.h.
+ */
+#ifndef __SYS_CTRL_H__
+#define __SYS_CTRL_H__
+
+void SysCtrlSystemReset(void);
+
+#endif // __SYS_CTRL_H__
@@ -0,0 +1,21 @@
+/*
+ * Host emulation of the subset of driverlib/vims.h used by Startup/ota.c.
+ * Backed by host/flash_emu.c.
+ */
+#ifndef __VIMS_H__
+#define __VIMS_H__
+
+#include <stdint.h>
+
+#define VIMS_BASE           0x40034000
+
+#define VIMS_MODE_DISABLED  0x00000000
+#define VIMS_MODE_ENABLED   0x00000001
+#define VIMS_MODE_OFF       0x00000003
+
+void VIMSModeSet(uint32_t ui32Base, uint32_t ui32Mode);
+uint32_t VIMSModeGet(uint32_t ui32Base);
+void VIMSLineBufDisable(uint32_t ui32Base);
+void VIMSLineBufEnable(uint32_t ui32Base);
+
+#endif // __VIMS_H__
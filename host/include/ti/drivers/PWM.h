@@ -0,0 +1,7 @@
+/*
+ * Empty stand-in for ti/drivers/PWM.h; Startup/ota.c includes it but the
+ * download engine does not use it.
+ */
+#ifndef ti_drivers_PWM__include
+#define ti_drivers_PWM__include
+#endif // ti_drivers_PWM__include
@@ -0,0 +1,11 @@
+/*
+ * Host emulation of the SYS/BIOS constants Startup/ota.c uses.
+ */
+#ifndef ti_sysbios_BIOS__include
+#define ti_sysbios_BIOS__include
+
+#include <xdc/std.h>
+
+#define BIOS_WAIT_FOREVER (~((UInt32) 0))
+
+#endif // ti_sysbios_BIOS__include
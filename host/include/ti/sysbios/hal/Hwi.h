@@ -0,0 +1,13 @@
+/*
+ * Host emulation of the Hwi_disable/Hwi_restore pair. The emulator tracks
+ * how long interrupts stay masked in simulated time.
+ */
+#ifndef ti_sysbios_hal_Hwi__include
+#define ti_sysbios_hal_Hwi__include
+
+#include <ti/sysbios/knl/Task.h>
+
+UInt Hwi_disable(void);
+void Hwi_restore(UInt key);
+
+#endif // ti_sysbios_hal_Hwi__include
@@ -0,0 +1,71 @@
+/*
+ * Host emulation of the TI-RTOS clock: the tick period ota_swap() sleeps
+ * in, as the BLE stack configures it, and one-shot clocks that only run
+ * when the bench fires the last one started through Clock_emu_last.
+ */
+#ifndef ti_sysbios_knl_Clock__include
+#define ti_sysbios_knl_Clock__include
+
+#include <xdc/std.h>
+
+/* Microseconds per Clock tick */
+#define Clock_tickPeriod 10
+
+typedef void (*Clock_FuncPtr)(UArg arg);
+
+typedef struct Clock_Params {
+    UInt32 period;
+    Bool startFlag;
+    UArg arg;
+} Clock_Params;
+
+typedef struct Clock_Struct {
+    Clock_FuncPtr fxn;
+    UInt32 timeout;
+    UArg arg;
+    Bool active;
+} Clock_Struct;
+
+typedef Clock_Struct *Clock_Handle;
+
+/* Defined in flash_emu.c */
+extern Clock_Struct *Clock_emu_last;
+
+static inline void Clock_Params_init(Clock_Params *params) {
+    params->period = 0;
+    params->startFlag = 0;
+    params->arg = 0;
+}
+
+static inline void Clock_construct(Clock_Struct *clock, Clock_FuncPtr fxn,
+                                   UInt32 timeout, const Clock_Params *params) {
+    clock->fxn = fxn;
+    clock->timeout = timeout;
+    clock->arg = params->arg;
+    clock->active = params->startFlag;
+}
+
+static inline Clock_Handle Clock_handle(Clock_Struct *clock) {
+    return clock;
+}
+
+static inline void Clock_setTimeout(Clock_Handle clock, UInt32 timeout) {
+    clock->timeout = timeout;
+}
+
+static inline void Clock_start(Clock_Handle clock) {
+    clock->active = 1;
+    Clock_emu_last = clock;
+}
+
+static inline void Clock_stop(Clock_Handle clock) {
+    clock->active = 0;
+}
+
+/* Expires a started clock, as if its timeout had passed. */
+static inline void Clock_emu_fire(Clock_Struct *clock) {
+    clock->active = 0;
+    clock->fxn(clock->arg);
+}
+
+#endif // ti_sysbios_knl_Clock__include
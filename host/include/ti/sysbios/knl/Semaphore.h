@@ -0,0 +1,36 @@
+/*
+ * Host emulation of the TI-RTOS semaphore behind the OTA worker queue. The
+ * bench drives the download engine directly, so it only has to count.
+ */
+#ifndef ti_sysbios_knl_Semaphore__include
+#define ti_sysbios_knl_Semaphore__include
+
+#include <xdc/std.h>
+
+typedef struct Semaphore_Struct {
+    int count;
+} Semaphore_Struct;
+
+typedef Semaphore_Struct *Semaphore_Handle;
+
+static inline void Semaphore_construct(Semaphore_Struct *sem, int count,
+                                       void *params) {
+    sem->count = count;
+}
+
+static inline Semaphore_Handle Semaphore_handle(Semaphore_Struct *sem) {
+    return sem;
+}
+
+static inline void Semaphore_post(Semaphore_Handle sem) {
+    sem->count++;
+}
+
+static inline Bool Semaphore_pend(Semaphore_Handle sem, UInt32 timeout) {
+    if (!sem->count)
+        return 0;
+    sem->count--;
+    return 1;
+}
+
+#endif // ti_sysbios_knl_Semaphore__include
@@ -0,0 +1,79 @@
+/*
+ * Host emulation of the TI-RTOS types Include/ota.h depends on. Tasks are
+ * never started: the bench calls the download engine from main(), and runs
+ * the payload task ota_startup() creates itself, through Task_emu_last.
+ * Task_sleep() stands for letting that task run: it runs it to completion.
+ */
+#ifndef ti_sysbios_knl_Task__include
+#define ti_sysbios_knl_Task__include
+
+#include <stddef.h>
+#include <xdc/std.h>
+
+typedef void (*ti_sysbios_knl_Task_FuncPtr)(UArg arg1, UArg arg2);
+typedef ti_sysbios_knl_Task_FuncPtr Task_FuncPtr;
+
+typedef struct Task_Params {
+    void *stack;
+    size_t stackSize;
+    int priority;
+} Task_Params;
+
+typedef enum Task_Mode {
+    Task_Mode_RUNNING,
+    Task_Mode_READY,
+    Task_Mode_BLOCKED,
+    Task_Mode_TERMINATED,
+    Task_Mode_INACTIVE,
+} Task_Mode;
+
+typedef struct Task_Struct {
+    Task_FuncPtr fxn;
+    size_t stackSize;
+    int priority;
+    Task_Mode mode;
+} Task_Struct;
+
+typedef Task_Struct *Task_Handle;
+
+/* The task constructed last; defined in flash_emu.c */
+extern Task_Struct *Task_emu_last;
+
+static inline void Task_Params_init(Task_Params *params) {
+    params->stack = NULL;
+    params->stackSize = 0;
+    params->priority = 1;
+}
+
+static inline void Task_construct(Task_Struct *task, Task_FuncPtr fxn,
+                                  const Task_Params *params, void *eb) {
+    task->fxn = fxn;
+    task->stackSize = params->stackSize;
+    task->priority = params->priority;
+    task->mode = Task_Mode_READY;
+    Task_emu_last = task;
+}
+
+static inline void Task_destruct(Task_Struct *task) {
+    task->fxn = NULL;
+}
+
+static inline Task_Handle Task_handle(Task_Struct *task) {
+    return task;
+}
+
+static inline Task_Mode Task_getMode(Task_Handle task) {
+    return task->mode;
+}
+
+/* Runs a task until its function returns. */
+static inline void Task_emu_run(Task_Struct *task) {
+    task->mode = Task_Mode_RUNNING;
+    task->fxn(0, 0);
+    task->mode = Task_Mode_TERMINATED;
+}
+
+/* Defined in flash_emu.c */
+void Task_sleep(UInt32 ticks);
+
+#endif // ti_sysbios_knl_Task__include
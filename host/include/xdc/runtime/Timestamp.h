@@ -0,0 +1,12 @@
+/*
+ * Host emulation of xdc.runtime.Timestamp. One tick is one nanosecond of
+ * simulated flash emulator time.
+ */
+#ifndef xdc_runtime_Timestamp__include
+#define xdc_runtime_Timestamp__include
+
+#include <xdc/std.h>
+
+Bits32 Timestamp_get32(void);
+
+#endif // xdc_runtime_Timestamp__include
@@ -0,0 +1,15 @@
+/*
+ * Host emulation of the XDC base types used by the TI-RTOS headers.
+ */
+#ifndef xdc_std__include
+#define xdc_std__include
+
+#include <stdint.h>
+
+typedef unsigned int UInt;
+typedef uint32_t UInt32;
+typedef unsigned short Bool;
+typedef uintptr_t UArg;
+typedef uint32_t Bits32;
+
+#endif // xdc_std__include
@@ -0,0 +1,1012 @@
+/*
+ * Host benchmark for the Startup/ota.c download engine.
+ *
+ * Feeds synthetic images through ota_dl_init/begin/process/finish the same
+ * way ota_transaction() does (68-byte chunk payloads, the first one sharing
+ * its room with the OTA header) and reports the simulated cost of each
+ * download as seen by the emulated flash in flash_emu.c, followed by the
+ * cost of the ota_startup() that boots it, which zero-fills bench_bss through
+ * an OTA_LOAD_ZERO_FILL load and scatters bench_data through a load table at
+ * the end of the payload, then creates the payload task with the stack and
+ * priority sent in an OTA_LOAD_TASK load. Each image is then downloaded
+ * again with a reset part way through and finished with ota_dl_resume(),
+ * and updated with a small OTA_ENC_DELTA patch against the booted image.
+ * Last, each image goes through OTA_ENC_LZ to compare transfer time and the
+ * host CPU time ota_dl_process() spends per payload byte with raw, and
+ * through OTA_ENC_SPARSE, whose erased runs are neither sent nor programmed,
+ * and is hot-swapped to with ota_swap() while another image runs. With
+ * OTA_BOOT_XIP, an image that misses its boot confirm and one that is
+ * rolled back give way to the previous image for a few bytes of metadata.
+ * Finally, an image linked for the wrong zone is refused without touching
+ * flash, and a corrupt one at its CRC check.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <Include/ota.h>
+#include <driverlib/flash.h>
+#include <ti/sysbios/knl/Clock.h>
+
+#include "flash_emu.h"
+
+/* _CHUNK_PAYLOAD_SIZE in prepare_blobs.py */
+#define BENCH_CHUNK_PAYLOAD 68
+/* sizeof (struct OTAHeader) on the target (32-bit uintptr_t) */
+#define BENCH_WIRE_HEADER   28
+/* Size of the ota_app/app.c demo payload */
+#define BENCH_DEMO_SIZE     180
+
+#define MAX_IMAGES 8
+
+/* Host "return" instruction placed at the image entrypoint. */
+#if defined(__x86_64__) || defined(__i386__)
+static const uint8_t bench_ret[] = { 0xc3 };
+#elif defined(__aarch64__)
+static const uint8_t bench_ret[] = { 0xc0, 0x03, 0x5f, 0xd6 };
+#else
+#error "ota_bench: no return stub for this host architecture"
+#endif
+
+struct bench_image {
+    const char *name;
+    size_t size;
+};
+
+/* ota_startup() calls this when no image is committed; never reached here. */
+void payload_test_app(UArg arg1, UArg arg2) {
+    (void) arg1;
+    (void) arg2;
+}
+
+/* Code-like random bytes with a 0xff-padded hole, as extract_ota.py emits. */
+static void fill_image(uint8_t *buf, size_t size, uint32_t seed) {
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+    if (size >= 64)
+        memset(&buf[size / 2], 0xff, size / 8);
+    memcpy(buf, bench_ret, sizeof (bench_ret));
+}
+
+static int verify(const struct ota_dl_state *s, const uint8_t *img) {
+    const struct ota_zone *z = s->target_zone;
+    if (memcmp(z->payload, img, s->dl_size))
+        return -1;
+    if (z->metadata.done != OTA_DONE_MAGIC ||
+        z->metadata.size != s->dl_size ||
+        z->metadata.gen != s->target_gen ||
+        z->metadata.crc != ota_crc32(0, img, s->dl_size))
+        return -1;
+    return 0;
+}
+
+/* Zero-initialized data of the image, set up by a load at boot */
+static uint8_t bench_bss[64];
+
+/* DEFINE_TASK() of the image */
+#define BENCH_TASK_STACK    768
+#define BENCH_TASK_PRIORITY 2
+
+static void bench_params(struct ota_dl_params *p, size_t size) {
+    ota_dl_params_init(p);
+    p->dl_size = size;
+    p->entrypoint = (ota_entrypoint_t) (uintptr_t)
+            (ota_dl_link_zone() * OTA_ZONE_SIZE);
+    p->loads[0].dest = (uintptr_t) bench_bss;
+    p->loads[0].offset = OTA_LOAD_ZERO_FILL;
+    p->loads[0].len = sizeof (bench_bss);
+    p->loads[2].dest = OTA_LOAD_TASK;
+    p->loads[2].offset = BENCH_TASK_PRIORITY;
+    p->loads[2].len = BENCH_TASK_STACK;
+}
+
+/* Small initialized objects, each loaded from the payload on its own */
+#define BENCH_DATA_LOADS    6
+#define BENCH_DATA_LEN      8
+#define BENCH_DATA_OFFSET   16
+#define BENCH_TABLE_SIZE    (BENCH_DATA_LOADS * sizeof (struct ota_load))
+
+static uint8_t bench_data[BENCH_DATA_LOADS][BENCH_DATA_LEN];
+
+/* Ends the image with a load table for bench_data and points p at it. */
+static void bench_load_table(uint8_t *img, size_t size, struct ota_dl_params *p) {
+    struct ota_load table[BENCH_DATA_LOADS];
+    size_t offset = (size - BENCH_TABLE_SIZE) & ~3;
+
+    if (size < BENCH_DATA_OFFSET + BENCH_DATA_LOADS * BENCH_DATA_LEN + BENCH_TABLE_SIZE + 4)
+        return;
+
+    for (int k = 0; k < BENCH_DATA_LOADS; k++) {
+        table[k].dest = (uintptr_t) bench_data[k];
+        table[k].offset = BENCH_DATA_OFFSET + k * BENCH_DATA_LEN;
+        table[k].len = BENCH_DATA_LEN;
+    }
+    memcpy(&img[offset], table, sizeof (table));
+
+    p->loads[1].dest = OTA_LOAD_TABLE;
+    p->loads[1].offset = offset;
+    p->loads[1].len = BENCH_DATA_LOADS;
+}
+
+/* Checks what the loads of bench_params() and bench_load_table() left. */
+static int bench_check_loads(const uint8_t *img, const struct ota_dl_params *p) {
+    for (size_t i = 0; i < sizeof (bench_bss); i++) {
+        if (bench_bss[i])
+            return -1;
+    }
+    if (p->loads[1].dest != OTA_LOAD_TABLE)
+        return 0;
+    for (int k = 0; k < BENCH_DATA_LOADS; k++) {
+        if (memcmp(bench_data[k], &img[BENCH_DATA_OFFSET + k * BENCH_DATA_LEN],
+                   BENCH_DATA_LEN))
+            return -1;
+    }
+    return 0;
+}
+
+static int run_image(const struct bench_image *im, uint64_t link_chunk_ns) {
+    static uint8_t img[OTA_PAYLOAD_SIZE];
+    struct ota_dl_params p;
+    struct ota_dl_state s;
+    unsigned chunks = 0;
+    size_t off = 0;
+    int rc;
+
+    fill_image(img, im->size, (uint32_t) im->size);
+
+    flash_emu_erase_all();
+    flash_emu_reset();
+    flash_emu_stats_reset();
+
+    // Entrypoint at offset 0 of whichever zone the engine expects
+    bench_params(&p, im->size);
+    bench_load_table(img, im->size, &p);
+    ota_dl_init(&s, &p);
+
+    flash_emu_advance(link_chunk_ns);
+    chunks++;
+    rc = ota_dl_begin(&s);
+    if (rc)
+        goto fail;
+    uint64_t begin_ns = flash_emu_stats.now_ns - link_chunk_ns;
+
+    size_t room = BENCH_CHUNK_PAYLOAD - BENCH_WIRE_HEADER;
+    while (off < im->size) {
+        size_t len = im->size - off < room ? im->size - off : room;
+        rc = ota_dl_process(&s, &img[off], len);
+        if (rc)
+            goto fail;
+        off += len;
+        if (off < im->size) {
+            flash_emu_advance(link_chunk_ns);
+            chunks++;
+        }
+        room = BENCH_CHUNK_PAYLOAD;
+    }
+
+    s.expected_crc = ota_crc32(0, img, im->size);
+    s.check_crc = 1;
+    rc = ota_dl_finish(&s);
+    if (rc)
+        goto fail;
+    if (verify(&s, img)) {
+        fprintf(stderr, "%s: zone contents do not match the image\n",
+                im->name);
+        return -1;
+    }
+
+    const struct flash_emu_stats dl = flash_emu_stats;
+    const struct ota_flash_stats dl_sessions = ota_flash_stats;
+
+    // Reboot into the new image
+    memset(bench_bss, 0xa5, sizeof (bench_bss));
+    memset(bench_data, 0xa5, sizeof (bench_data));
+    Task_emu_last = NULL;
+    flash_emu_reset();
+    ota_startup();
+    uint64_t boot_ns = flash_emu_stats.now_ns - dl.now_ns;
+    uint32_t boot_erases = flash_emu_stats.erases - dl.erases;
+    if (bench_check_loads(img, &p)) {
+        fprintf(stderr, "%s: boot did not run the image's loads\n", im->name);
+        return -1;
+    }
+    Task_Struct *task = Task_emu_last;
+    if (!task || task->stackSize != BENCH_TASK_STACK ||
+        task->priority != BENCH_TASK_PRIORITY) {
+        fprintf(stderr, "%s: boot did not create the payload task\n", im->name);
+        return -1;
+    }
+    // What BIOS_start() would run: the return stub at the entrypoint
+    Task_emu_run(task);
+
+    printf("%-6s %6zu %6u %6u %7u %8llu %7u %7u %5u %10.1f %9.1f %10.1f %9.1f %9.2f %4u %8.2f %7u\n",
+           im->name, im->size, chunks, dl.erases, dl.program_calls,
+           (unsigned long long) dl.bytes_programmed,
+           dl.cache_toggles, dl.hwi_disables, dl_sessions.sessions,
+           dl.hwi_masked_ns / 1e3, dl.hwi_masked_max_ns / 1e3,
+           dl.flash_busy_ns / 1e3, begin_ns / 1e3, dl.now_ns / 1e6,
+           dl.unsafe_ops, boot_ns / 1e6, boot_erases);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: download failed at offset %zu (rc=%d)\n",
+            im->name, off, rc);
+    return -1;
+}
+
+/* Interrupts a download at `cut` bytes, then resumes and commits it. */
+static int run_resume(const struct bench_image *im, size_t cut) {
+    static uint8_t img[OTA_PAYLOAD_SIZE];
+    struct ota_dl_params p;
+    struct ota_dl_state s;
+    size_t point = 0;
+    uint32_t crc;
+    int rc;
+
+    fill_image(img, im->size, (uint32_t) im->size);
+    flash_emu_erase_all();
+    flash_emu_reset();
+
+    bench_params(&p, im->size);
+    ota_dl_init(&s, &p);
+    rc = ota_dl_begin(&s);
+    if (!rc)
+        rc = ota_dl_process(&s, img, cut);
+    if (rc)
+        goto fail;
+
+    // Reset: whatever was staged in row_buf is gone
+    flash_emu_reset();
+    flash_emu_stats_reset();
+
+    // A different image must not continue this download
+    bench_params(&p, im->size - 4);
+    ota_dl_init(&s, &p);
+    if (ota_dl_resume_point(&point, &crc) == 0 &&
+        ota_dl_resume(&s, point) != OTA_ERR_RESUME_MISMATCH) {
+        fprintf(stderr, "%s: resumed with other parameters\n", im->name);
+        return -1;
+    }
+    flash_emu_reset();
+    bench_params(&p, im->size);
+    ota_dl_init(&s, &p);
+    rc = ota_dl_begin(&s);
+    if (!rc)
+        rc = ota_dl_process(&s, img, cut);
+    if (rc)
+        goto fail;
+    flash_emu_reset();
+    flash_emu_stats_reset();
+
+    ota_dl_init(&s, &p);
+    rc = ota_dl_resume_point(&point, &crc);
+    if (rc == OTA_ERR_NO_RESUME) {
+        point = 0;
+        rc = ota_dl_begin(&s);
+    }
+    else if (!rc) {
+        if (point > cut || crc != ota_crc32(0, img, point)) {
+            fprintf(stderr, "%s: bad resume point %zu\n", im->name, point);
+            return -1;
+        }
+        rc = ota_dl_resume(&s, point);
+    }
+    if (!rc)
+        rc = ota_dl_process(&s, &img[point], im->size - point);
+    if (rc)
+        goto fail;
+
+    s.expected_crc = ota_crc32(0, img, im->size);
+    s.check_crc = 1;
+    rc = ota_dl_finish(&s);
+    if (rc)
+        goto fail;
+    if (verify(&s, img)) {
+        fprintf(stderr, "%s: resumed zone does not match the image\n",
+                im->name);
+        return -1;
+    }
+
+    printf("resume %-6s cut at %6zu, continued from %6zu, %7llu bytes programmed after the reset\n",
+           im->name, cut, point,
+           (unsigned long long) flash_emu_stats.bytes_programmed);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: resumed download failed (rc=%d)\n", im->name, rc);
+    return -1;
+}
+
+static size_t delta_copy(uint8_t *ops, size_t offset, size_t len) {
+    ops[0] = OTA_OP_COPY;
+    ops[1] = offset;
+    ops[2] = offset >> 8;
+    ops[3] = len;
+    ops[4] = len >> 8;
+    return OTA_OP_MAX_SIZE;
+}
+
+static size_t delta_literal(uint8_t *ops, const uint8_t *buf, size_t len) {
+    ops[0] = len - 1;
+    memcpy(&ops[1], buf, len);
+    return len + 1;
+}
+
+/* Boots an image, then patches DELTA_EDITS bytes of it with a delta. */
+#define DELTA_EDITS 3
+#define DELTA_EDIT_LEN 16
+
+static int run_delta(const struct bench_image *im) {
+    static uint8_t img[OTA_PAYLOAD_SIZE];
+    static uint8_t new_img[OTA_PAYLOAD_SIZE];
+    static uint8_t ops[OTA_PAYLOAD_SIZE];
+    struct ota_dl_params p;
+    struct ota_dl_state s;
+    size_t n = 0, off = 0;
+    uint32_t crc;
+    int rc;
+
+    if (im->size < DELTA_EDITS * 2 * DELTA_EDIT_LEN)
+        return 0;
+
+    fill_image(img, im->size, (uint32_t) im->size);
+    flash_emu_erase_all();
+    flash_emu_reset();
+
+    bench_params(&p, im->size);
+    ota_dl_init(&s, &p);
+    rc = ota_dl_begin(&s);
+    if (!rc)
+        rc = ota_dl_process(&s, img, im->size);
+    if (!rc)
+        rc = ota_dl_finish(&s);
+    if (rc)
+        goto fail;
+    flash_emu_reset();
+    ota_startup();
+
+    // The same image with a few small edits
+    memcpy(new_img, img, im->size);
+    crc = ota_crc32(0, img, im->size);
+    memcpy(ops, &crc, sizeof (crc));
+    n = sizeof (crc);
+    for (int i = 0; i < DELTA_EDITS; i++) {
+        size_t at = im->size * (i + 1) / (DELTA_EDITS + 1);
+        for (int j = 0; j < DELTA_EDIT_LEN; j++)
+            new_img[at + j] ^= 0x5a;
+        n += delta_copy(&ops[n], off, at - off);
+        n += delta_literal(&ops[n], &new_img[at], DELTA_EDIT_LEN);
+        off = at + DELTA_EDIT_LEN;
+    }
+    n += delta_copy(&ops[n], off, im->size - off);
+
+    flash_emu_reset();
+    flash_emu_stats_reset();
+    bench_params(&p, im->size);
+    p.encoding = OTA_ENC_DELTA;
+    ota_dl_init(&s, &p);
+    rc = ota_dl_begin(&s);
+    for (off = 0; !rc && off < n; off += BENCH_CHUNK_PAYLOAD) {
+        size_t len = n - off < BENCH_CHUNK_PAYLOAD ? n - off : BENCH_CHUNK_PAYLOAD;
+        rc = ota_dl_process(&s, &ops[off], len);
+    }
+    if (rc)
+        goto fail;
+
+    s.expected_crc = ota_crc32(0, new_img, im->size);
+    s.check_crc = 1;
+    rc = ota_dl_finish(&s);
+    if (rc)
+        goto fail;
+    if (verify(&s, new_img)) {
+        fprintf(stderr, "%s: patched zone does not match the image\n",
+                im->name);
+        return -1;
+    }
+
+    printf("delta  %-6s %6zu stream bytes instead of %6zu, %7llu bytes programmed\n",
+           im->name, n, im->size,
+           (unsigned long long) flash_emu_stats.bytes_programmed);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: delta download failed (rc=%d)\n", im->name, rc);
+    return -1;
+}
+
+/* Greedy OTA_ENC_LZ encoder, one candidate per 3-byte hash. */
+#define LZ_HASH_BITS 12
+#define LZ_MATCH_MAX (0x7f + OTA_OP_MATCH_MIN)
+
+static size_t lz_literals(uint8_t *out, const uint8_t *buf, size_t len) {
+    size_t n = 0;
+    while (len) {
+        size_t piece = len < OTA_OP_LITERAL_MAX ? len : OTA_OP_LITERAL_MAX;
+        n += delta_literal(&out[n], buf, piece);
+        buf += piece;
+        len -= piece;
+    }
+    return n;
+}
+
+static size_t lz_compress(uint8_t *out, const uint8_t *in, size_t size) {
+    static size_t head[1 << LZ_HASH_BITS];
+    size_t n = 0, lit = 0, i = 0;
+
+    for (size_t h = 0; h < (1 << LZ_HASH_BITS); h++)
+        head[h] = (size_t) -1;
+
+    while (i < size) {
+        size_t best = 0, dist = 0;
+
+        if (i + OTA_OP_MATCH_MIN <= size) {
+            uint32_t key = in[i] | (in[i + 1] << 8) | (in[i + 2] << 16);
+            size_t h = (key * 2654435761u) >> (32 - LZ_HASH_BITS);
+            size_t cand[2] = { head[h], i - 1 };
+
+            head[h] = i;
+            for (int k = 0; k < 2; k++) {
+                size_t c = cand[k], len = 0;
+                if (c >= i || i - c > OTA_LZ_DISTANCE_MAX)
+                    continue;
+                while (i + len < size && len < LZ_MATCH_MAX &&
+                       in[c + len] == in[i + len])
+                    len++;
+                if (len > best) {
+                    best = len;
+                    dist = i - c;
+                }
+            }
+        }
+
+        if (best < OTA_OP_MATCH_MIN) {
+            i++;
+            continue;
+        }
+
+        n += lz_literals(&out[n], &in[lit], i - lit);
+        out[n++] = 0x80 | (best - OTA_OP_MATCH_MIN);
+        if (dist - 1 < OTA_OP_FAR) {
+            out[n++] = dist - 1;
+        }
+        else {
+            out[n++] = OTA_OP_FAR | ((dist - 1) >> 8);
+            out[n++] = dist - 1;
+        }
+        i += best;
+        lit = i;
+    }
+    return n + lz_literals(&out[n], &in[lit], size - lit);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define LZ_ROUNDS 50
+
+/*
+ * Downloads a stream in chunks and checks the zone against img. The
+ * simulated cost is left in flash_emu_stats, and the host time spent in
+ * ota_dl_process() is added to *cpu_ns.
+ */
+static int stream_download(const struct bench_image *im, const uint8_t *img,
+                           const uint8_t *stream, size_t n, uint8_t encoding,
+                           uint64_t link_chunk_ns, double *cpu_ns) {
+    struct ota_dl_params p;
+    struct ota_dl_state s;
+    int rc;
+
+    flash_emu_erase_all();
+    flash_emu_reset();
+    flash_emu_stats_reset();
+
+    bench_params(&p, im->size);
+    p.encoding = encoding;
+    ota_dl_init(&s, &p);
+    rc = ota_dl_begin(&s);
+    for (size_t off = 0; !rc && off < n; off += BENCH_CHUNK_PAYLOAD) {
+        size_t len = n - off < BENCH_CHUNK_PAYLOAD ? n - off : BENCH_CHUNK_PAYLOAD;
+        flash_emu_advance(link_chunk_ns);
+        double t0 = now_ns();
+        rc = ota_dl_process(&s, (uint8_t *) &stream[off], len);
+        *cpu_ns += now_ns() - t0;
+    }
+    if (!rc) {
+        s.expected_crc = ota_crc32(0, img, im->size);
+        s.check_crc = 1;
+        rc = ota_dl_finish(&s);
+    }
+    if (!rc && verify(&s, img))
+        rc = OTA_ERR_CRC_MISMATCH;
+    return rc;
+}
+
+static int run_lz(const struct bench_image *im, uint64_t link_chunk_ns) {
+    static uint8_t img[OTA_PAYLOAD_SIZE];
+    static uint8_t lz[OTA_PAYLOAD_SIZE + OTA_PAYLOAD_SIZE / OTA_OP_LITERAL_MAX + 1];
+    double raw_cpu = 0, lz_cpu = 0;
+    uint64_t raw_ns = 0, lz_ns = 0;
+    int rc = 0;
+
+    fill_image(img, im->size, (uint32_t) im->size);
+    size_t n = lz_compress(lz, img, im->size);
+
+    for (int r = 0; !rc && r < LZ_ROUNDS; r++) {
+        rc = stream_download(im, img, img, im->size, OTA_ENC_RAW,
+                             link_chunk_ns, &raw_cpu);
+        raw_ns = flash_emu_stats.now_ns;
+        if (!rc)
+            rc = stream_download(im, img, lz, n, OTA_ENC_LZ,
+                                 link_chunk_ns, &lz_cpu);
+        lz_ns = flash_emu_stats.now_ns;
+    }
+    if (rc) {
+        fprintf(stderr, "%s: compressed download failed (rc=%d)\n",
+                im->name, rc);
+        return -1;
+    }
+
+    printf("lz     %-6s %6zu -> %6zu bytes, e2e %8.2f -> %8.2f ms, "
+           "process %5.1f -> %5.1f ns/B\n",
+           im->name, im->size, n, raw_ns / 1e6, lz_ns / 1e6,
+           raw_cpu / LZ_ROUNDS / im->size, lz_cpu / LZ_ROUNDS / im->size);
+    return 0;
+}
+
+/* OTA_ENC_SPARSE encoder: runs of SPARSE_RUN_MIN or more 0xff bytes. */
+#define SPARSE_RUN_MIN 3
+
+static size_t sparse_encode(uint8_t *out, const uint8_t *in, size_t size) {
+    size_t n = 0, lit = 0, i = 0;
+
+    while (i < size) {
+        size_t run = 0;
+        while (i + run < size && in[i + run] == 0xff)
+            run++;
+        if (run < SPARSE_RUN_MIN) {
+            i += run ? run : 1;
+            continue;
+        }
+
+        n += lz_literals(&out[n], &in[lit], i - lit);
+        i += run;
+        lit = i;
+        for (; run; run -= run < OTA_OP_LITERAL_MAX ? run : OTA_OP_LITERAL_MAX)
+            out[n++] = 0x80 | ((run < OTA_OP_LITERAL_MAX ? run : OTA_OP_LITERAL_MAX) - 1);
+    }
+    return n + lz_literals(&out[n], &in[lit], size - lit);
+}
+
+static int run_sparse(const struct bench_image *im, uint64_t link_chunk_ns) {
+    static uint8_t img[OTA_PAYLOAD_SIZE];
+    static uint8_t ops[OTA_PAYLOAD_SIZE + OTA_PAYLOAD_SIZE / OTA_OP_LITERAL_MAX + 1];
+    double cpu = 0;
+
+    fill_image(img, im->size, (uint32_t) im->size);
+    size_t n = sparse_encode(ops, img, im->size);
+
+    int rc = stream_download(im, img, ops, n, OTA_ENC_SPARSE,
+                             link_chunk_ns, &cpu);
+    if (rc) {
+        fprintf(stderr, "%s: sparse download failed (rc=%d)\n", im->name, rc);
+        return -1;
+    }
+
+    printf("sparse %-6s %6zu -> %6zu bytes, %7llu bytes programmed in %u calls, "
+           "e2e %8.2f ms\n",
+           im->name, im->size, n,
+           (unsigned long long) flash_emu_stats.bytes_programmed,
+           flash_emu_stats.program_calls, flash_emu_stats.now_ns / 1e6);
+    return 0;
+}
+
+static int bench_commit(const struct bench_image *im, uint8_t *img,
+                        struct ota_dl_params *p) {
+    struct ota_dl_state s;
+    int rc;
+
+    ota_dl_init(&s, p);
+    rc = ota_dl_begin(&s);
+    if (!rc)
+        rc = ota_dl_process(&s, img, im->size);
+    if (!rc)
+        rc = ota_dl_finish(&s);
+    return rc;
+}
+
+/*
+ * Boots an image, then commits another and hot-swaps to it while the first
+ * one's task has not run yet; ota_swap() sleeping lets it return. Swapping
+ * again then has to fail: the new payload is left out of Task_sleep() so it
+ * never returns, and without OTA_BOOT_XIP the copy has locked the active
+ * zone before that is even tried.
+ */
+static int run_swap(const struct bench_image *im) {
+    static uint8_t img[OTA_PAYLOAD_SIZE];
+    static uint8_t new_img[OTA_PAYLOAD_SIZE];
+    struct ota_dl_params p;
+    int rc;
+
+    fill_image(img, im->size, (uint32_t) im->size);
+    fill_image(new_img, im->size, (uint32_t) im->size + 1);
+    flash_emu_erase_all();
+    flash_emu_reset();
+
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img, &p);
+    if (rc)
+        goto fail;
+    // The boot that copies the image leaves the active zone locked
+    flash_emu_reset();
+    ota_startup();
+    flash_emu_reset();
+    ota_startup();
+
+    bench_params(&p, im->size);
+    bench_load_table(new_img, im->size, &p);
+    rc = bench_commit(im, new_img, &p);
+    if (rc)
+        goto fail;
+
+    memset(bench_bss, 0xa5, sizeof (bench_bss));
+    memset(bench_data, 0xa5, sizeof (bench_data));
+    flash_emu_stats_reset();
+    rc = ota_swap();
+    if (rc)
+        goto fail;
+    uint64_t swap_ns = flash_emu_stats.now_ns;
+    uint32_t swap_erases = flash_emu_stats.erases;
+    Task_Struct *task = Task_emu_last;
+    const struct ota_zone *live = &OTA_REGION->zones[ota_live_zone()];
+    if (task->mode != Task_Mode_READY || bench_check_loads(new_img, &p) ||
+        (const uint8_t *) task->fxn != live->payload ||
+        memcmp(live->payload, new_img, im->size)) {
+        fprintf(stderr, "%s: swap did not start the new image\n", im->name);
+        return -1;
+    }
+
+#if OTA_BOOT_XIP == 1
+    const int again = OTA_ERR_SWAP_TIMEOUT;
+#else
+    const int again = OTA_ERR_SWAP_LOCKED;
+#endif
+    Task_emu_last = NULL;
+    rc = ota_swap();
+    Task_emu_last = task;
+    if (rc != again || task->mode != Task_Mode_READY) {
+        fprintf(stderr, "%s: second swap returned %d instead of %d\n",
+                im->name, rc, again);
+        return -1;
+    }
+    Task_emu_run(task);
+
+    printf("swap   %-6s stop %6.2f ms, swap %7.2f ms, %2u erases, "
+           "then rc %d after %7.2f ms\n",
+           im->name, ota_swap_stats.stop_ticks / 1e6, swap_ns / 1e6,
+           swap_erases, rc, (flash_emu_stats.now_ns - swap_ns) / 1e6);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: swap failed (rc=%d)\n", im->name, rc);
+    return -1;
+}
+
+static void bench_boot(void) {
+    Task_emu_last = NULL;
+    flash_emu_reset();
+    ota_startup();
+}
+
+#if OTA_BOOT_XIP == 1
+static int bench_live(const uint8_t *img, size_t size) {
+    return !memcmp(OTA_REGION->zones[ota_live_zone()].payload, img, size);
+}
+#endif
+
+/*
+ * A/B images go back to the previous one without a download: once when the
+ * new one is not confirmed in time, once on ota_rollback(). Both only
+ * program a mark into the metadata. An image committed since the last reset
+ * cannot be rolled back, as its zone is still write-protected.
+ */
+static int run_rollback(const struct bench_image *im) {
+    static uint8_t img[3][OTA_PAYLOAD_SIZE];
+    struct ota_dl_params p;
+    const char *what;
+    int rc;
+
+    for (int i = 0; i < 3; i++)
+        fill_image(img[i], im->size, (uint32_t) im->size + 2 + i);
+    flash_emu_erase_all();
+    flash_emu_reset();
+
+#if OTA_BOOT_XIP == 1
+    // Nothing to go back to: the first image is not on trial
+    what = "first image";
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img[0], &p);
+    if (rc)
+        goto fail;
+    bench_boot();
+    if (ota_on_trial())
+        goto bad;
+
+    what = "fallback";
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img[1], &p);
+    if (rc)
+        goto fail;
+    bench_boot();
+    if (!ota_on_trial() || !Clock_emu_last || !Clock_emu_last->active ||
+        !bench_live(img[1], im->size))
+        goto bad;
+    flash_emu_stats_reset();
+    Clock_emu_fire(Clock_emu_last);
+    if (flash_emu_stats.resets != 1)
+        goto bad;
+    bench_boot();
+    const struct flash_emu_stats fallback = flash_emu_stats;
+    if (ota_on_trial() || !bench_live(img[0], im->size))
+        goto bad;
+
+    what = "confirm";
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img[1], &p);
+    if (rc)
+        goto fail;
+    bench_boot();
+    rc = ota_confirm();
+    if (rc)
+        goto fail;
+    bench_boot();
+    if (ota_on_trial() || !bench_live(img[1], im->size))
+        goto bad;
+
+    what = "rollback";
+    flash_emu_stats_reset();
+    rc = ota_rollback();
+    if (!rc)
+        rc = ota_swap();
+    if (rc)
+        goto fail;
+    const struct flash_emu_stats rollback = flash_emu_stats;
+    if (!bench_live(img[0], im->size) || bench_check_loads(img[0], &p))
+        goto bad;
+
+    what = "locked rollback";
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img[2], &p);
+    if (!rc)
+        rc = ota_swap();
+    if (rc)
+        goto fail;
+    rc = ota_rollback();
+    if (!rc || ota_rollback_stats.last_rc != rc || !bench_live(img[2], im->size))
+        goto bad;
+
+    printf("rollbk %-6s fallback %2u erases %3llu bytes programmed, "
+           "rollback %2u erases %3llu bytes programmed, swap %6.2f ms\n",
+           im->name, fallback.erases,
+           (unsigned long long) fallback.bytes_programmed, rollback.erases,
+           (unsigned long long) rollback.bytes_programmed,
+           ota_swap_stats.swap_ticks / 1e6);
+#else
+    what = "rollback";
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img[0], &p);
+    if (rc)
+        goto fail;
+    bench_boot();
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img[1], &p);
+    if (rc)
+        goto fail;
+    bench_boot();
+    // The copy at boot overwrote the previous image
+    if (ota_rollback() != OTA_ERR_NO_ROLLBACK || ota_on_trial())
+        goto bad;
+    printf("rollbk %-6s needs OTA_BOOT_XIP\n", im->name);
+#endif
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: %s went wrong\n", im->name, what);
+    return -1;
+
+fail:
+    fprintf(stderr, "%s: %s failed (rc=%d)\n", im->name, what, rc);
+    return -1;
+}
+
+/*
+ * Images the board has to refuse without hanging: one linked for the wrong
+ * zone, before flash is touched, and one that fails its CRC check, which
+ * leaves nothing to resume. A refused download leaves the board ready for
+ * the next one, which is committed right after.
+ */
+static int run_refuse(const struct bench_image *im) {
+    static uint8_t img[OTA_PAYLOAD_SIZE];
+    struct ota_dl_params p;
+    struct ota_dl_state s;
+    int rc;
+
+    fill_image(img, im->size, (uint32_t) im->size);
+    flash_emu_erase_all();
+    flash_emu_reset();
+    flash_emu_stats_reset();
+
+    // Linked for the zone it would not be written to
+    bench_params(&p, im->size);
+    p.entrypoint = (ota_entrypoint_t) (uintptr_t)
+            ((ota_dl_link_zone() + 1) % NR_OTA_ZONES * OTA_ZONE_SIZE);
+    ota_dl_init(&s, &p);
+    rc = ota_dl_begin(&s);
+    if (rc != OTA_ERR_ZONE_MISMATCH || flash_emu_stats.erases ||
+        flash_emu_stats.bytes_programmed) {
+        fprintf(stderr, "%s: wrong-zone image not refused (rc=%d)\n",
+                im->name, rc);
+        return -1;
+    }
+    const int zone_rc = rc;
+    const struct flash_emu_stats zone = flash_emu_stats;
+
+    // Corrupt on the way: the CRC trailer does not match
+    bench_params(&p, im->size);
+    ota_dl_init(&s, &p);
+    rc = ota_dl_begin(&s);
+    if (!rc)
+        rc = ota_dl_process(&s, img, im->size);
+    if (rc)
+        goto fail;
+    s.expected_crc = ota_crc32(0, img, im->size) ^ 1;
+    s.check_crc = 1;
+    rc = ota_dl_finish(&s);
+    size_t dl_done;
+    uint32_t crc;
+    if (rc != OTA_ERR_CRC_MISMATCH ||
+        ota_dl_resume_point(&dl_done, &crc) != OTA_ERR_NO_RESUME) {
+        fprintf(stderr, "%s: corrupt image not refused (rc=%d)\n",
+                im->name, rc);
+        return -1;
+    }
+    const int crc_rc = rc;
+
+    bench_params(&p, im->size);
+    rc = bench_commit(im, img, &p);
+    if (rc)
+        goto fail;
+
+    printf("refuse %-6s wrong zone rc %d, %u erases %4llu bytes programmed, "
+           "bad CRC rc %d, then committed\n",
+           im->name, zone_rc, zone.erases,
+           (unsigned long long) zone.bytes_programmed, crc_rc);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: download around a refused one failed (rc=%d)\n",
+            im->name, rc);
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-p program_ns_per_byte] [-P program_call_ns]\n"
+            "          [-e erase_us_per_sector] [-c cache_toggle_ns]\n"
+            "          [-l link_us_per_chunk] [-s image_size]...\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct bench_image images[MAX_IMAGES] = {
+        { "demo", BENCH_DEMO_SIZE },
+        { "half", OTA_PAYLOAD_SIZE / 2 },
+        { "full", OTA_PAYLOAD_SIZE },
+    };
+    size_t nr_images = 3;
+    int custom = 0;
+    /* Write-with-response: two 7.5 ms connection events per chunk. */
+    uint64_t link_chunk_ns = 15000000;
+    int opt;
+    int ret = 0;
+
+    while ((opt = getopt(argc, argv, "p:P:e:c:l:s:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            flash_emu_timing.program_byte_ns = strtoull(optarg, NULL, 0);
+            break;
+        case 'P':
+            flash_emu_timing.program_call_ns = strtoull(optarg, NULL, 0);
+            break;
+        case 'e':
+            flash_emu_timing.erase_sector_ns = strtoull(optarg, NULL, 0) * 1000;
+            break;
+        case 'c':
+            flash_emu_timing.cache_toggle_ns = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            link_chunk_ns = strtoull(optarg, NULL, 0) * 1000;
+            break;
+        case 's':
+            if (!custom) {
+                nr_images = 0;
+                custom = 1;
+            }
+            if (nr_images == MAX_IMAGES)
+                usage(argv[0]);
+            images[nr_images].name = "custom";
+            images[nr_images].size = strtoul(optarg, NULL, 0);
+            if (!images[nr_images].size ||
+                images[nr_images].size > OTA_PAYLOAD_SIZE) {
+                fprintf(stderr, "image size must be 1..%zu\n",
+                        (size_t) OTA_PAYLOAD_SIZE);
+                return 2;
+            }
+            nr_images++;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (ota_crc32(0, (const uint8_t *) "123456789", 9) != 0xcbf43926) {
+        fprintf(stderr, "ota_crc32 check value mismatch\n");
+        return 1;
+    }
+
+    if (flash_emu_init())
+        return 1;
+
+    printf("program %llu ns/B + %llu ns/call, erase %llu us/sector, "
+           "cache toggle %llu ns, link %llu us/chunk\n",
+           (unsigned long long) flash_emu_timing.program_byte_ns,
+           (unsigned long long) flash_emu_timing.program_call_ns,
+           (unsigned long long) flash_emu_timing.erase_sector_ns / 1000,
+           (unsigned long long) flash_emu_timing.cache_toggle_ns,
+           (unsigned long long) link_chunk_ns / 1000);
+    printf("%-6s %6s %6s %6s %7s %8s %7s %7s %5s %10s %9s %10s %9s %9s %4s %8s %7s\n",
+           "image", "bytes", "chunks", "erases", "progs", "prog_B",
+           "vims", "hwi_off", "sess", "masked_us", "max_us", "flash_us",
+           "begin_us", "e2e_ms", "bad", "boot_ms", "boot_er");
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_image(&images[i], link_chunk_ns))
+            ret = 1;
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_resume(&images[i], images[i].size * 3 / 5))
+            ret = 1;
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_delta(&images[i]))
+            ret = 1;
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_lz(&images[i], link_chunk_ns))
+            ret = 1;
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_sparse(&images[i], link_chunk_ns))
+            ret = 1;
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_swap(&images[i]))
+            ret = 1;
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_rollback(&images[i]))
+            ret = 1;
+
+    for (size_t i = 0; i < nr_images; i++)
+        if (run_refuse(&images[i]))
+            ret = 1;
+
+    return ret;
+}
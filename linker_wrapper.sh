@@ -21,9 +21,18 @@ done
 
 echo OUTFILE: $OUTFILE | tee -a /tmp/l
 echo $@ | tee -a /tmp/l
+
+# A/B execute-in-place firmware (OTA_BOOT_XIP=1) needs a second image linked
+# for zone 1. Link it first so the final $OUTFILE and map are the zone 0 ones.
+if [ "$OTA_BOOT_XIP" = "1" ]; then
+	echo Linking zone 1 image | tee -a /tmp/l
+	$@ --define=OTA_LINK_SLOT=1
+	python ../extract_ota.py --ota-slot 1 --container ota.slot1.bin $OUTFILE ota_app/*.obj > ota.slot1.json
+fi
+
 $@
 
 echo Working Directory: $(pwd) | tee -a /tmp/l
-echo Running python ../extract_ota.py $OUTFILE ota_app/*.obj \> ota.json | tee -a /tmp/l
+echo Running python ../extract_ota.py --container ota.bin $OUTFILE ota_app/*.obj \> ota.json | tee -a /tmp/l
 echo $OBJCOPY --dump-section .ota.text=output.bin $OUTFILE | tee -a /tmp/l
-python ../extract_ota.py $OUTFILE ota_app/*.obj > ota.json
+python ../extract_ota.py --container ota.bin $OUTFILE ota_app/*.obj > ota.json
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <ti/drivers/PWM.h>
+#include <ti/sysbios/knl/Clock.h>
 #include <ti/sysbios/knl/Task.h>
 
 #include <../boards/_CC1350_LAUNCHXL/_Board.h>
@@ -26,5 +27,14 @@ void payload_test_app(UArg arg1, UArg arg2) {
     PWM_start(pwm);
     if (payload_data == 5)
         payload_data = strlen(payload_string) + strlen(payload_literal);
+    // Up and running: an update on trial is kept from now on
+    ota_confirm();
+
+    // Hand the LED back before a hot swap starts the next image
+    while (!ota_payload_stopping())
+        Task_sleep(10000 / Clock_tickPeriod);
+    PWM_stop(pwm);
+    PWM_close(pwm);
 }
 DEFINE_ENTRYPOINT(payload_test_app);
+DEFINE_TASK(512, 1);
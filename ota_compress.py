@@ -0,0 +1,210 @@
+#!/usr/bin/env python3
+"""
+Compressed OTA images.
+
+extract_ota.py payloads carry zero-padded holes between segments and
+zero-filled .ota.data placeholders. An OTA_ENC_LZ stream (Include/ota.h)
+sends the payload as ops the board decompresses while it downloads:
+
+    0x00..0x7f  literal, op + 1 payload bytes follow
+    0x80..0xff  match, (op & 0x7f) + 3 bytes that appeared distance bytes
+                earlier; distance - 1 follows as one byte if below 0x80,
+                else as two bytes, big-endian, top bit set
+
+Matches point back into the payload the board already has in flash, so it
+decompresses without a window buffer. The header and the CRC trailer are
+those of the image.
+
+An OTA_ENC_SPARSE stream only shortens runs of erased bytes, the 0xff
+padding extract_ota.py puts between segments, which the board then does not
+program either:
+
+    0x00..0x7f  literal, as above
+    0x80..0xff  (op & 0x7f) + 1 bytes of 0xff
+
+    ota_compress.py [--sparse] ota.bin ota.lz.bin
+
+takes a container or an ota.json written by extract_ota.py and writes a
+container with the compressed stream. ota_send.py --compress (--sparse) does
+the same on the fly.
+"""
+import argparse
+
+import ota_container
+import ota_delta
+
+OP_LITERAL_MAX = 0x80
+MATCH_MIN = 3
+MATCH_MAX = 0x7f + MATCH_MIN
+DISTANCE_MAX = 0x8000
+_FAR = 0x80
+# Earlier positions tried per match, newest first
+_CHAIN = 32
+ERASED = 0xff
+# Shorter runs of erased bytes cost less as part of a literal
+_ERASED_RUN_MIN = 3
+
+
+def _match_op(len_, distance):
+    d = distance - 1
+    if d < _FAR:
+        return bytes([0x80 | (len_ - MATCH_MIN), d])
+    return bytes([0x80 | (len_ - MATCH_MIN), _FAR | (d >> 8), d & 0xff])
+
+
+def compress(payload, start=0):
+    """
+    Returns the ops producing payload[start:]. Matches may reach back
+    before start, into what the board holds already.
+    """
+    payload = bytes(payload)
+    chains = {}
+    ops = bytearray()
+    lit = bytearray()
+
+    def insert(i):
+        chains.setdefault(payload[i:i + MATCH_MIN], []).append(i)
+
+    for i in range(max(0, start - DISTANCE_MAX), start):
+        insert(i)
+
+    i = start
+    while i < len(payload):
+        best, best_dist = 0, 0
+        for c in reversed(chains.get(payload[i:i + MATCH_MIN], [])[-_CHAIN:]):
+            if i - c > DISTANCE_MAX:
+                break
+            n = 0
+            while (i + n < len(payload) and n < MATCH_MAX and
+                   payload[c + n] == payload[i + n]):
+                n += 1
+            if n > best:
+                best, best_dist = n, i - c
+        # A far match of 3 costs as much as the literals
+        if best > MATCH_MIN or (best == MATCH_MIN and best_dist <= _FAR):
+            ota_delta.pack_literals(ops, lit)
+            ops += _match_op(best, best_dist)
+            for j in range(i, i + best):
+                insert(j)
+            i += best
+        else:
+            lit.append(payload[i])
+            insert(i)
+            i += 1
+    ota_delta.pack_literals(ops, lit)
+    return bytes(ops)
+
+
+def decompress(ops, prefix=b''):
+    """Returns the payload bytes ops produce after prefix."""
+    out = bytearray(prefix)
+    i = 0
+    while i < len(ops):
+        op = ops[i]
+        if op < OP_LITERAL_MAX:
+            out += ops[i + 1:i + 2 + op]
+            i += op + 2
+            continue
+        d = ops[i + 1]
+        if d & _FAR:
+            d = ((d & 0x7f) << 8) | ops[i + 2]
+            i += 3
+        else:
+            i += 2
+        if d + 1 > len(out):
+            raise ValueError('match before the start of the payload')
+        for _ in range((op & 0x7f) + MATCH_MIN):
+            out.append(out[-(d + 1)])
+    return bytes(out[len(prefix):])
+
+
+def sparse(payload, start=0):
+    """Returns the OTA_ENC_SPARSE ops producing payload[start:]."""
+    payload = bytes(payload)
+    ops = bytearray()
+    lit = bytearray()
+    i = start
+    while i < len(payload):
+        run = 0
+        while i + run < len(payload) and payload[i + run] == ERASED:
+            run += 1
+        if run < _ERASED_RUN_MIN:
+            lit += payload[i:i + max(run, 1)]
+            i += max(run, 1)
+            continue
+        ota_delta.pack_literals(ops, lit)
+        i += run
+        while run:
+            n = min(run, OP_LITERAL_MAX)
+            ops.append(0x80 | (n - 1))
+            run -= n
+    ota_delta.pack_literals(ops, lit)
+    return bytes(ops)
+
+
+def unsparse(ops):
+    """Returns the payload bytes OTA_ENC_SPARSE ops produce."""
+    out = bytearray()
+    i = 0
+    while i < len(ops):
+        op = ops[i]
+        if op < OP_LITERAL_MAX:
+            out += ops[i + 1:i + 2 + op]
+            i += op + 2
+        else:
+            out += bytes([ERASED]) * ((op & 0x7f) + 1)
+            i += 1
+    return bytes(out)
+
+
+def _encoded_stream(stream, ops):
+    hs = ota_container.stream_header_size()
+    payload = stream[hs:len(stream) - 4]
+    return bytes(stream[:hs]) + ops(payload) + bytes(stream[len(stream) - 4:])
+
+
+def lz_stream(stream, start=0):
+    """
+    Returns the OTA_ENC_LZ stream for a raw stream from ota_container,
+    producing its payload from byte start on.
+    """
+    return _encoded_stream(stream, lambda p: compress(p, start))
+
+
+def sparse_stream(stream, start=0):
+    """Like lz_stream(), for OTA_ENC_SPARSE."""
+    return _encoded_stream(stream, lambda p: sparse(p, start))
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('image', type=str, help='container or ota.json')
+    parser.add_argument('out', type=str, help='compressed container to write')
+    parser.add_argument(
+        '--sparse',
+        action='store_true',
+        help='Only shorten runs of erased bytes (OTA_ENC_SPARSE)',
+    )
+    return parser.parse_args()
+
+
+def main():
+    opts = parse_args()
+    stream, slot = ota_delta.load_stream(opts.image)
+    hs = ota_container.stream_header_size()
+    if opts.sparse:
+        lz = sparse_stream(stream)
+        encoding = ota_container.OTA_ENC_SPARSE
+        assert unsparse(lz[hs:-4]) == stream[hs:-4]
+    else:
+        lz = lz_stream(stream)
+        encoding = ota_container.OTA_ENC_LZ
+        assert decompress(lz[hs:-4]) == stream[hs:-4]
+
+    with open(opts.out, 'wb') as f:
+        f.write(ota_container.pack_file(lz, slot, encoding))
+    print('{0} bytes on the wire instead of {1}'.format(len(lz), len(stream)))
+
+
+if __name__ == '__main__':
+    main()
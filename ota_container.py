@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""
+Binary OTA container.
+
+The file is a small header followed by the exact byte stream the board
+receives over BLE, so a sender can mmap it and cut chunks straight out of
+the stream:
+
+    file header (20 bytes)
+        char magic[4]      'OTAI'
+        u16  version       1
+        u16  header_size   20
+        u8   slot          OTA zone the image was linked for
+        u8   nr_loads      entries in the load table (3)
+        u8   encoding      how the payload is sent, OTA_ENC_*
+        u8   reserved
+        u32  stream_size   bytes after the file header
+        u32  stream_crc    CRC32 of those bytes
+    stream
+        u16  entrypoint    slot * OTA_ZONE_SIZE + offset of the entrypoint
+        u16  size          payload bytes
+        load table         nr_loads * {u32 dest, u16 offset, u16 len},
+                           offset 0xffff zero-fills dest, dest 0xffffffff
+                           is a table of len more loads at offset, dest
+                           0xfffffffe the payload task's priority (offset)
+                           and stack size (len)
+        payload            code + data, or ops producing them (ota_delta.py,
+                           ota_compress.py)
+        u32  crc           CRC32 of the payload, checked on the board
+
+All fields are little-endian. The stream part is struct OTAHeader, the
+image and the CRC trailer of simple_gatt_profile.c.
+
+    ota_container.py convert ota.json ota.bin    legacy JSON to container
+    ota_container.py info ota.bin
+"""
+import argparse
+import json
+import mmap
+import struct
+import zlib
+
+OTA_CONTAINER_MAGIC = b'OTAI'
+OTA_CONTAINER_VERSION = 1
+OTA_ZONE_SIZE = 0x1000
+# OTA_METADATA_SIZE in Include/ota.h, checked against sizeof (struct
+# ota_metadata) when ota.c builds; the rest of a zone is payload
+# (FLASH_OTA_PAYLOAD_LEN in TOOLS/cc26xx_app.cmd)
+OTA_METADATA_SIZE = 196
+OTA_PAYLOAD_SIZE = OTA_ZONE_SIZE - OTA_METADATA_SIZE
+OTA_MAX_LOADS = 3
+OTA_LOAD_ZERO_FILL = 0xffff
+OTA_LOAD_TABLE = 0xffffffff
+OTA_LOAD_TASK = 0xfffffffe
+# Include/ota.h
+OTA_ENC_RAW = 0
+OTA_ENC_DELTA = 1
+OTA_ENC_LZ = 2
+OTA_ENC_SPARSE = 3
+_ENCODING_NAMES = {
+    OTA_ENC_DELTA: 'delta',
+    OTA_ENC_LZ: 'compressed',
+    OTA_ENC_SPARSE: 'sparse',
+}
+
+_FILE_HEADER = struct.Struct('<4sHHBBBBLL')
+_STREAM_HEADER = struct.Struct('<HH')
+_LOAD = struct.Struct('<LHH')
+_CRC = struct.Struct('<L')
+
+
+def stream_header_size(nr_loads=OTA_MAX_LOADS):
+    return _STREAM_HEADER.size + nr_loads * _LOAD.size
+
+
+def pack_loads(loads):
+    """Returns loads as a table of struct ota_load."""
+    return b''.join(_LOAD.pack(l['dest'], l['offset'], l['len']) for l in loads)
+
+
+def unpack_loads(buf, offset, nr_loads):
+    return [dict(zip(('dest', 'offset', 'len'),
+                     _LOAD.unpack_from(buf, offset + i * _LOAD.size)))
+            for i in range(nr_loads)]
+
+
+def pack_stream(entrypoint, slot, loads, data):
+    """Returns the bytes the board receives for an image."""
+    # The device derives the zone an image was linked for from the entrypoint.
+    res = _STREAM_HEADER.pack(slot * OTA_ZONE_SIZE + entrypoint, len(data))
+    empty = {'dest': 0, 'offset': 0, 'len': 0}
+    res += pack_loads((list(loads) + [empty] * OTA_MAX_LOADS)[:OTA_MAX_LOADS])
+    # The device checks the image against this CRC32 before committing it.
+    return res + bytes(data) + _CRC.pack(zlib.crc32(data))
+
+
+def pack_file(stream, slot, encoding=OTA_ENC_RAW):
+    """Returns a container around a stream."""
+    return _FILE_HEADER.pack(
+        OTA_CONTAINER_MAGIC,
+        OTA_CONTAINER_VERSION,
+        _FILE_HEADER.size,
+        slot,
+        OTA_MAX_LOADS,
+        encoding,
+        0,
+        len(stream),
+        zlib.crc32(stream),
+    ) + stream
+
+
+def pack(entrypoint, slot, loads, data):
+    """Returns a whole container for an image."""
+    return pack_file(pack_stream(entrypoint, slot, loads, data), slot)
+
+
+def _json_image(ota):
+    data = ota['data']
+    if isinstance(data, str):
+        data = bytes.fromhex(data)
+    return ota['entrypoint'], ota.get('slot', 0), ota['loads'], data
+
+
+def pack_json(ota):
+    """Returns a container for the dictionary extract_ota.py prints."""
+    return pack(*_json_image(ota))
+
+
+def stream_from_json(ota):
+    """Returns the board's byte stream for the dictionary extract_ota.py prints."""
+    return pack_stream(*_json_image(ota))
+
+
+class OTAContainer(object):
+    """A container file, mapped rather than read."""
+
+    def __init__(self, path):
+        self._file = open(path, 'rb')
+        self._map = mmap.mmap(self._file.fileno(), 0, access=mmap.ACCESS_READ)
+        self._view = view = memoryview(self._map)
+        if len(view) < _FILE_HEADER.size:
+            raise ValueError('{0}: too short for an OTA container'.format(path))
+        (magic, version, header_size, self.slot, nr_loads, self.encoding, _,
+         stream_size, stream_crc) = _FILE_HEADER.unpack_from(view)
+        if magic != OTA_CONTAINER_MAGIC or version != OTA_CONTAINER_VERSION:
+            raise ValueError('{0}: not a version {1} OTA container'.format(
+                path, OTA_CONTAINER_VERSION))
+        if header_size + stream_size != len(view):
+            raise ValueError('{0}: truncated'.format(path))
+        self.stream = view[header_size:]
+        if zlib.crc32(self.stream) != stream_crc:
+            raise ValueError('{0}: CRC mismatch'.format(path))
+
+        self.entrypoint, self.size = _STREAM_HEADER.unpack_from(self.stream)
+        self.loads = unpack_loads(self.stream, _STREAM_HEADER.size, nr_loads)
+        start = stream_header_size(nr_loads)
+        # What is sent for the payload; the payload itself when raw
+        self.data = self.stream[start:len(self.stream) - _CRC.size]
+        self.payload = self.data if self.encoding == OTA_ENC_RAW else None
+        self.crc, = _CRC.unpack_from(self.stream, len(self.stream) - _CRC.size)
+
+    def close(self):
+        self.data.release()
+        self.stream.release()
+        self._view.release()
+        self._map.close()
+        self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    sub = parser.add_subparsers(dest='cmd')
+    sub.required = True
+    convert = sub.add_parser('convert', help='legacy ota.json to container')
+    convert.add_argument('ota_json', type=str)
+    convert.add_argument('container', type=str)
+    info = sub.add_parser('info', help='print a container')
+    info.add_argument('container', type=str)
+    return parser.parse_args()
+
+
+def main():
+    opts = parse_args()
+    if opts.cmd == 'convert':
+        with open(opts.ota_json) as f:
+            ota = json.load(f)
+        with open(opts.container, 'wb') as f:
+            f.write(pack_json(ota))
+        return
+
+    with OTAContainer(opts.container) as c:
+        print('slot {0}, entrypoint 0x{1:04x}, {2} payload bytes, crc 0x{3:08x}'
+              .format(c.slot, c.entrypoint, c.size, c.crc))
+        if c.encoding != OTA_ENC_RAW:
+            print('{0}, {1} bytes of ops'.format(
+                _ENCODING_NAMES.get(c.encoding, c.encoding), len(c.data)))
+        loads = list(c.loads)
+        while loads:
+            load = loads.pop(0)
+            if load['dest'] == OTA_LOAD_TABLE:
+                print('load table offset 0x{offset:04x}, {len} loads'
+                      .format(**load))
+                if c.payload is not None:
+                    loads[:0] = unpack_loads(c.payload, load['offset'],
+                                             load['len'])
+            elif load['dest'] == OTA_LOAD_TASK:
+                print('task stack {len} bytes, priority {offset}'
+                      .format(**load))
+            elif load['offset'] == OTA_LOAD_ZERO_FILL:
+                print('load dest 0x{dest:08x} zero-fill len {len}'
+                      .format(**load))
+            else:
+                print('load dest 0x{dest:08x} offset 0x{offset:04x} len {len}'
+                      .format(**load))
+        print('{0} bytes on the wire'.format(len(c.stream)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""
+Delta OTA images.
+
+Most updates change a few hundred bytes of a payload that otherwise matches
+the one the board runs. A delta stream rebuilds the new payload out of the
+old one, so only the changes go over the air; the board applies it while it
+downloads (OTA_ENC_DELTA in Include/ota.h). In place of the payload the
+stream carries the CRC32 of the payload it was made against, then ops:
+
+    0x00..0x7f  literal, op + 1 payload bytes follow
+    0x80        copy, u16 offset and u16 len of bytes from the old payload
+
+All little-endian. The header and the CRC trailer are those of the new
+image, so the board still checks what it rebuilt.
+
+    ota_delta.py old.bin new.bin delta.bin
+
+takes the image the board runs and the new one (containers or ota.json
+written by extract_ota.py) and writes a container with the delta stream.
+ota_send.py --delta-from old.bin new.bin makes the same stream on the fly.
+"""
+import argparse
+import json
+import struct
+import zlib
+
+import ota_container
+
+OP_LITERAL_MAX = 0x80
+OP_COPY = 0x80
+
+_COPY = struct.Struct('<BHH')
+_CRC = struct.Struct('<L')
+_COPY_MAX = 0xffff
+# Matches are looked up by their first _BLOCK bytes
+_BLOCK = 8
+# A copy shorter than this costs more than the literal bytes
+_MIN_COPY = _COPY.size + 2
+
+
+def _index(old):
+    index = {}
+    for i in range(len(old) - _BLOCK + 1):
+        index.setdefault(bytes(old[i:i + _BLOCK]), i)
+    return index
+
+
+def _match_len(old, new, src, dst):
+    n = 0
+    while (src + n < len(old) and dst + n < len(new) and n < _COPY_MAX and
+           old[src + n] == new[dst + n]):
+        n += 1
+    return n
+
+
+def pack_literals(ops, lit):
+    """Appends literal ops carrying lit to ops and empties lit."""
+    for i in range(0, len(lit), OP_LITERAL_MAX):
+        piece = lit[i:i + OP_LITERAL_MAX]
+        ops.append(len(piece) - 1)
+        ops += piece
+    del lit[:]
+
+
+def diff(old, new, start=0):
+    """Returns the ops that produce new[start:] out of old."""
+    index = _index(old)
+    ops = bytearray()
+    lit = bytearray()
+    i = start
+    while i < len(new):
+        best, best_src = 0, 0
+        # Unchanged layout first, then wherever the bytes moved to
+        for src in (i, index.get(bytes(new[i:i + _BLOCK]))):
+            if src is None or src >= len(old):
+                continue
+            n = _match_len(old, new, src, i)
+            if n > best:
+                best, best_src = n, src
+        if best >= _MIN_COPY:
+            pack_literals(ops, lit)
+            ops += _COPY.pack(OP_COPY, best_src, best)
+            i += best
+        else:
+            lit.append(new[i])
+            i += 1
+    pack_literals(ops, lit)
+    return bytes(ops)
+
+
+def iter_ops(ops):
+    """Yields (offset, len) for copies and bytes for literals."""
+    i = 0
+    while i < len(ops):
+        op = ops[i]
+        if op < OP_LITERAL_MAX:
+            yield bytes(ops[i + 1:i + 2 + op])
+            i += op + 2
+        elif op == OP_COPY:
+            _, offset, len_ = _COPY.unpack_from(ops, i)
+            yield offset, len_
+            i += _COPY.size
+        else:
+            raise ValueError('bad op 0x{0:02x} at {1}'.format(op, i))
+
+
+def apply(old, data):
+    """Returns the payload bytes a delta stream's data produces from old."""
+    base_crc, = _CRC.unpack_from(data)
+    if base_crc != zlib.crc32(old):
+        raise ValueError('delta made against another image')
+    out = bytearray()
+    for op in iter_ops(data[_CRC.size:]):
+        if isinstance(op, bytes):
+            out += op
+        else:
+            offset, len_ = op
+            out += old[offset:offset + len_]
+    return bytes(out)
+
+
+def delta_stream(stream, old, start=0):
+    """
+    Returns the OTA_ENC_DELTA stream for a raw stream from ota_container,
+    producing its payload from byte start on out of the old payload.
+    """
+    hs = ota_container.stream_header_size()
+    payload = stream[hs:len(stream) - _CRC.size]
+    return (bytes(stream[:hs]) + _CRC.pack(zlib.crc32(old)) +
+            diff(old, payload, start) + bytes(stream[len(stream) - _CRC.size:]))
+
+
+def load_stream(path):
+    """Returns the raw stream and slot of a container or an ota.json."""
+    if path.endswith('.json'):
+        with open(path) as f:
+            ota = json.load(f)
+        return ota_container.stream_from_json(ota), ota.get('slot', 0)
+    with ota_container.OTAContainer(path) as c:
+        if c.encoding != ota_container.OTA_ENC_RAW:
+            raise ValueError('{0}: not a full image'.format(path))
+        return bytes(c.stream), c.slot
+
+
+def load_payload(path):
+    """Returns the payload of a container or an ota.json."""
+    stream, _ = load_stream(path)
+    return stream[ota_container.stream_header_size():-_CRC.size]
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('old', type=str, help='image the board runs')
+    parser.add_argument('new', type=str, help='image to update it to')
+    parser.add_argument('delta', type=str, help='delta container to write')
+    return parser.parse_args()
+
+
+def main():
+    opts = parse_args()
+    old = load_payload(opts.old)
+    stream, slot = load_stream(opts.new)
+    delta = delta_stream(stream, old)
+
+    hs = ota_container.stream_header_size()
+    copied = literal = 0
+    for op in iter_ops(delta[hs + _CRC.size:-_CRC.size]):
+        if isinstance(op, bytes):
+            literal += len(op)
+        else:
+            copied += op[1]
+    assert apply(old, delta[hs:-_CRC.size]) == stream[hs:-_CRC.size]
+
+    with open(opts.delta, 'wb') as f:
+        f.write(ota_container.pack_file(delta, slot, ota_container.OTA_ENC_DELTA))
+    print('{0} bytes on the wire instead of {1}: {2} bytes copied, {3} sent'
+          .format(len(delta), len(stream), copied, literal))
+
+
+if __name__ == '__main__':
+    main()
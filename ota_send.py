@@ -0,0 +1,847 @@
+#!/usr/bin/python3
+"""
+Pushes an OTA image to the board over a single BLE connection.
+
+Chunks are written to characteristic 0xFFF3 as write commands, a window at
+a time, and the board acks them over 0xFFF6 (see "Transfer window" in the
+README). Only the chunks an ack reports missing are sent again. The chunk
+size follows the board's 0xFFF7 capabilities unless the chunks come from a
+prepare_blobs.py directory. Once the transfer runs, the connection
+parameters the board asked for and got are read from 0xFFF8.
+
+A transfer starts with a write to 0xFFF9. If the board reports there that
+it already holds the start of this image from an interrupted download, only
+the rest is sent. With --delta-from, or a container from ota_delta.py, only
+the changes from the image the board runs go over the air; --compress, or a
+container from ota_compress.py, sends the image compressed (--sparse only
+shortens its runs of erased bytes).
+
+Once the image is in, the board starts it without a reset where it can;
+0xFFFA then reports how long the swap took.
+
+--mock runs the same protocol against an in-process model of the board, so
+the sender can be exercised without a radio.
+"""
+import argparse
+import json
+import os
+import random
+import re
+import struct
+import sys
+import time
+import zlib
+
+import ota_compress
+import ota_container
+import ota_delta
+import prepare_blobs
+
+OTA_CHUNK_UUID = 0xfff3
+OTA_ACK_UUID = 0xfff6
+OTA_CAPS_UUID = 0xfff7
+OTA_LINK_UUID = 0xfff8
+OTA_RESUME_UUID = 0xfff9
+OTA_SWAP_UUID = 0xfffa
+CCCD_UUID = 0x2902
+
+OTA_MAGIC_V1 = 0xdabad000
+OTA_MAGIC_V2 = 0xdabad002
+OTA_ACK_BUSY = 0
+OTA_ACK_DONE = 1
+OTA_ACK_ERROR = 2
+OTA_HEADER_SIZE = 28
+
+_ACK_FORMAT = '<HBB'
+_CAPS_FORMAT = '<HBB'
+_LINK_FORMAT = '<HHHHHHB'
+_LINK_INTERVAL_MS = 1.25
+_RESUME_FORMAT = '<LLB'
+_RESUME_RETRIES = 10
+_SWAP_FORMAT = '<HLLHbB'
+# Commit, the payload's OTA_SWAP_TIMEOUT_MS and a zone copy
+_SWAP_TIMEOUT = 2.0
+# What the mock board reports: one Task_sleep() for the payload to return
+_MOCK_SWAP_US = 1000
+# The board checkpoints its download once per flash row
+_MOCK_ROW_SIZE = 256
+# OTA_MAX_BLOB_SIZE: the image header, a whole zone payload and the CRC
+_MOCK_MAX_BLOB_SIZE = OTA_HEADER_SIZE + ota_container.OTA_PAYLOAD_SIZE + 4
+_DEFAULT_WINDOW = 8
+_ACK_TIMEOUT = 0.5
+_MAX_STALLS = 10
+
+
+class LinkLost(Exception):
+    """The connection went away, e.g. because the board rebooted."""
+
+
+class Refused(Exception):
+    """The board answered a write request with an ATT error."""
+
+
+def parse_chunk(chunk):
+    """Returns (cur_chunk, num_chunks, total_size, payload) of a chunk."""
+    magic, = struct.unpack_from('<L', chunk)
+    if magic == OTA_MAGIC_V2:
+        fmt = '<LLHHHH'
+    elif magic == OTA_MAGIC_V1:
+        fmt = '<LHBBHH'
+    else:
+        raise ValueError('bad chunk magic 0x{0:08x}'.format(magic))
+    header_len = struct.calcsize(fmt)
+    if len(chunk) < header_len:
+        raise ValueError('chunk header is {0} bytes'.format(len(chunk)))
+    _, total_size, cur, num, _, chunk_len = struct.unpack_from(fmt, chunk)
+    if len(chunk) < header_len + chunk_len:
+        raise ValueError('chunk {0} is truncated'.format(cur))
+    return cur, num, total_size, chunk[header_len:header_len + chunk_len]
+
+
+class Ack(object):
+    def __init__(self, base=0, bitmap=0, status=OTA_ACK_BUSY):
+        self.base = base
+        self.bitmap = bitmap
+        self.status = status
+
+    @classmethod
+    def unpack(cls, raw):
+        return cls(*struct.unpack_from(_ACK_FORMAT, raw))
+
+    def has(self, chunk):
+        if chunk < self.base:
+            return True
+        if chunk == self.base or chunk - self.base > 8:
+            return False
+        return bool(self.bitmap & (1 << (chunk - self.base - 1)))
+
+    def __eq__(self, other):
+        return (self.base, self.bitmap) == (other.base, other.bitmap)
+
+
+class BluepyTransport(object):
+    """A live connection through bluepy (pip install bluepy)."""
+
+    def __init__(self, mac, mtu):
+        from bluepy import btle
+        self._btle = btle
+        self._acks = []
+        try:
+            self._dev = btle.Peripheral(mac)
+            self._dev.withDelegate(self)
+            if mtu:
+                self._dev.setMTU(mtu)
+            self._chunk = self._char(OTA_CHUNK_UUID)
+            self._ack = self._char(OTA_ACK_UUID)
+            self._caps = self._char(OTA_CAPS_UUID, required=False)
+            self._link = self._char(OTA_LINK_UUID, required=False)
+            self._resume = self._char(OTA_RESUME_UUID, required=False)
+            self._swap = self._char(OTA_SWAP_UUID, required=False)
+            cccd = self._ack.getDescriptors(forUUID=CCCD_UUID)[0]
+            cccd.write(b'\x01\x00', withResponse=True)
+        except btle.BTLEDisconnectError as e:
+            raise LinkLost(str(e))
+
+    def _char(self, uuid, required=True):
+        chars = self._dev.getCharacteristics(uuid=self._btle.UUID(uuid))
+        if not chars:
+            if required:
+                raise RuntimeError('no characteristic 0x{0:04x}'.format(uuid))
+            return None
+        return chars[0]
+
+    # bluepy delegate
+    def handleNotification(self, handle, data):
+        if handle == self._ack.getHandle():
+            self._acks.append(data)
+
+    def now(self):
+        return time.monotonic()
+
+    def write(self, chunk, response):
+        try:
+            self._chunk.write(chunk, withResponse=response)
+        except self._btle.BTLEGattError as e:
+            # e.g. chunk 0 of an image linked for the wrong zone
+            raise Refused(str(e))
+        except self._btle.BTLEDisconnectError as e:
+            raise LinkLost(str(e))
+
+    def wait_ack(self, timeout):
+        deadline = time.monotonic() + timeout
+        try:
+            while not self._acks:
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    return None
+                self._dev.waitForNotifications(left)
+        except self._btle.BTLEDisconnectError as e:
+            raise LinkLost(str(e))
+        raw = self._acks[-1]
+        del self._acks[:]
+        return Ack.unpack(raw)
+
+    def read_ack(self):
+        try:
+            return Ack.unpack(self._ack.read())
+        except self._btle.BTLEDisconnectError as e:
+            raise LinkLost(str(e))
+
+    def read_caps(self):
+        if self._caps is None:
+            return None
+        return struct.unpack_from(_CAPS_FORMAT, self._caps.read())
+
+    def read_link(self):
+        if self._link is None:
+            return None
+        try:
+            return struct.unpack_from(_LINK_FORMAT, self._link.read())
+        except self._btle.BTLEDisconnectError as e:
+            raise LinkLost(str(e))
+
+    def read_resume(self):
+        if self._resume is None:
+            return None
+        try:
+            return struct.unpack_from(_RESUME_FORMAT, self._resume.read())[:2]
+        except self._btle.BTLEDisconnectError as e:
+            raise LinkLost(str(e))
+
+    def write_resume(self, offset, crc, encoding):
+        value = struct.pack(_RESUME_FORMAT, offset, crc, encoding)
+        for _ in range(_RESUME_RETRIES):
+            try:
+                self._resume.write(value, withResponse=True)
+                return
+            except self._btle.BTLEGattError:
+                # the board is still working through the last transfer
+                time.sleep(_ACK_TIMEOUT)
+            except self._btle.BTLEDisconnectError as e:
+                raise LinkLost(str(e))
+        raise RuntimeError('the board refused to start a transfer')
+
+    def read_swap(self):
+        if self._swap is None:
+            return None
+        try:
+            return struct.unpack_from(_SWAP_FORMAT, self._swap.read())
+        except self._btle.BTLEDisconnectError as e:
+            raise LinkLost(str(e))
+
+    def close(self):
+        try:
+            self._dev.disconnect()
+        except self._btle.BTLEException:
+            pass
+
+
+class MockTransport(object):
+    """
+    The reassembly of simple_gatt_profile.c behind a simulated link.
+
+    Time is virtual: a write command costs a share of a connection event, a
+    write request and a notification cost a full event, and lost writes
+    vanish. Like the board, the mock swaps to the image once it is complete,
+    or goes away as if it reset when `reset` is set.
+
+    preload() stands in for an earlier, interrupted download, and `active`
+    is the payload deltas are applied to. Images linked for another zone
+    than `zone` are refused at chunk 0, and with `corrupt` a byte flips on
+    the way, so the image fails its CRC check.
+
+    Chunks are checked in the board's order: the header first, then the
+    window drops resends, then the index is checked against the size of the
+    transfer. The running byte count is only checked as chunks are taken
+    in, as the worker does. A refused write request raises Refused; a
+    refused write command is lost.
+    """
+
+    def __init__(self, max_chunk, window, interval_ms, per_event, loss, seed,
+                 reset=False, zone=0, corrupt=False):
+        self.max_chunk = max_chunk
+        self.window = window
+        self.interval = interval_ms / 1000.
+        self.per_event = per_event
+        self.loss = loss
+        self._rand = random.Random(seed)
+        self._now = 0.
+        self._next = 0
+        self._buffered = {}
+        self._image = bytearray()
+        self._size = None
+        self._ack_pending = False
+        self._closed = False
+        self._done = False
+        self._failed = False
+        self._reset = reset
+        self._zone = zone
+        self._corrupt = corrupt
+        self._swaps = 0
+        self._held = b''
+        self._skip = 0
+        self._encoding = ota_container.OTA_ENC_RAW
+        self.active = None
+        self.image = None
+
+    def now(self):
+        return self._now
+
+    def _process(self, cur, num, payload):
+        self._image += payload
+        self._next += 1
+        while self._next in self._buffered:
+            self._image += self._buffered.pop(self._next)
+            self._next += 1
+        if len(self._image) > self._size[0]:
+            self._fail()
+            return
+        if self._next == num:
+            if self._reset:
+                self._closed = True
+            else:
+                self._done = True
+                self._ack_pending = True
+            image = bytes(self._image)
+            data = image[OTA_HEADER_SIZE:-4]
+            held = self._held[:self._skip]
+            try:
+                if self._encoding == ota_container.OTA_ENC_DELTA:
+                    data = ota_delta.apply(self.active, data)
+                elif self._encoding == ota_container.OTA_ENC_LZ:
+                    data = ota_compress.decompress(data, held)
+                elif self._encoding == ota_container.OTA_ENC_SPARSE:
+                    data = ota_compress.unsparse(data)
+            except (TypeError, ValueError, IndexError):
+                self._fail()
+                return
+            if self._corrupt and data:
+                data = bytes([data[0] ^ 1]) + data[1:]
+            if zlib.crc32(held + data) != struct.unpack('<L', image[-4:])[0]:
+                self._fail()
+                return
+            self.image = image[:OTA_HEADER_SIZE] + held + data + image[-4:]
+            self._swaps += 1
+        elif self._next % self.window == 0:
+            self._ack_pending = True
+
+    def _fail(self):
+        # the worker drops the transfer and notifies the error, even after
+        # the last window was acked
+        self._failed = True
+        self._done = False
+        self._closed = False
+        self._ack_pending = True
+
+    def _check_blob(self, chunk):
+        try:
+            cur, num, total_size, payload = parse_chunk(chunk)
+        except ValueError:
+            return None
+        if not 0 < total_size <= _MOCK_MAX_BLOB_SIZE:
+            return None
+        if not 0 < len(payload) <= self.max_chunk or cur >= num:
+            return None
+        return cur, num, total_size, payload
+
+    def _receive(self, chunk, response):
+        blob = self._check_blob(chunk)
+        if blob is None:
+            if response:
+                raise Refused('malformed chunk')
+            return
+        cur, num, total_size, payload = blob
+        if (self._failed or self._done) and cur == 0:
+            self._restart()
+        if (self._failed or self._done or cur < self._next or
+                cur >= self._next + self.window):
+            self._ack_pending = True
+            return
+        if (cur * len(payload) >= total_size or
+                self._size not in (None, (total_size, num))):
+            if response:
+                raise Refused('chunk {0} does not fit the transfer'.format(cur))
+            return
+        self._size = (total_size, num)
+        if cur == 0 and len(payload) >= 2:
+            entrypoint, = struct.unpack_from('<H', payload)
+            if entrypoint // ota_container.OTA_ZONE_SIZE != self._zone:
+                self._failed = True
+                self._buffered = {}
+                self._ack_pending = True
+                if response:
+                    raise Refused('chunk 0 is for zone {0}'.format(
+                        entrypoint // ota_container.OTA_ZONE_SIZE))
+                return
+        if cur != self._next:
+            self._buffered[cur] = payload
+            self._ack_pending = True
+        else:
+            self._process(cur, num, payload)
+
+    def _restart(self):
+        self._next = 0
+        self._buffered = {}
+        self._image = bytearray()
+        self._size = None
+        self._done = False
+        self._failed = False
+        # like a write of zeroes to 0xFFF9: a whole, raw image
+        self._skip = 0
+        self._encoding = ota_container.OTA_ENC_RAW
+
+    def _ack(self):
+        bitmap = 0
+        for idx in self._buffered:
+            bitmap |= 1 << (idx - self._next - 1)
+        if self._failed:
+            status = OTA_ACK_ERROR
+        elif self._done:
+            status = OTA_ACK_DONE
+        else:
+            status = OTA_ACK_BUSY
+        return Ack(self._next, bitmap, status)
+
+    def write(self, chunk, response):
+        if self._closed:
+            raise LinkLost('board rebooted')
+        if response:
+            self._now += self.interval
+        else:
+            self._now += self.interval / self.per_event
+            if self._rand.random() < self.loss:
+                return
+        self._receive(chunk, response)
+
+    def wait_ack(self, timeout):
+        if self._closed:
+            raise LinkLost('board rebooted')
+        if not self._ack_pending:
+            self._now += timeout
+            return None
+        self._ack_pending = False
+        self._now += self.interval
+        return self._ack()
+
+    def read_ack(self):
+        if self._closed:
+            raise LinkLost('board rebooted')
+        self._now += self.interval
+        return self._ack()
+
+    def read_caps(self):
+        return self.max_chunk, self.window, 2
+
+    def preload(self, stream, nbytes):
+        """The board holds the first nbytes of the image in stream."""
+        nbytes -= nbytes % _MOCK_ROW_SIZE
+        self._held = bytes(stream[OTA_HEADER_SIZE:OTA_HEADER_SIZE + nbytes])
+
+    def read_resume(self):
+        self._now += self.interval
+        return len(self._held), zlib.crc32(self._held)
+
+    def write_resume(self, offset, crc, encoding):
+        self._now += self.interval
+        if offset and (offset, crc) != (len(self._held), zlib.crc32(self._held)):
+            raise RuntimeError('the board refused to start a transfer')
+        self._skip = offset
+        self._encoding = encoding
+
+    def read_link(self):
+        # the simulated central grants whatever --mock-interval says
+        interval = int(round(self.interval * 1000 / _LINK_INTERVAL_MS))
+        return 6, 6, 0, interval, 0, 1000, 1
+
+    def read_swap(self):
+        if self._closed:
+            raise LinkLost('board rebooted')
+        self._now += self.interval
+        swap_us = _MOCK_SWAP_US if self._swaps else 0
+        # Without OTA_BOOT_XIP there is nothing to roll back to
+        return self._swaps, swap_us, swap_us, 0, 0, 0
+
+    def close(self):
+        pass
+
+
+class Stats(object):
+    def __init__(self, chunks):
+        self.chunks = chunks
+        self.first_sent = {}
+        self.latency = {}
+        self.writes = 0
+        self.wire_bytes = 0
+        self.start = None
+        self.end = None
+        self.link = None
+
+    def sent(self, idx, now):
+        if self.start is None:
+            self.start = now
+        self.first_sent.setdefault(idx, now)
+        self.writes += 1
+        self.wire_bytes += len(self.chunks[idx])
+        self.end = now
+
+    def acked(self, ack, now):
+        for idx in self.first_sent:
+            if idx not in self.latency and ack.has(idx):
+                self.latency[idx] = now - self.first_sent[idx]
+
+    def report(self, verbose):
+        image_bytes = sum(len(parse_chunk(c)[3]) for c in self.chunks)
+        elapsed = max((self.end or 0) - (self.start or 0), 1e-9)
+        if verbose:
+            for idx in sorted(self.first_sent):
+                lat = self.latency.get(idx)
+                print('chunk {0:4d}: {1}'.format(
+                    idx,
+                    '{0:8.2f} ms'.format(lat * 1000) if lat is not None
+                    else 'committed on reboot',
+                ))
+        if self.link is not None:
+            min_int, max_int, req_lat, interval, lat, _, fast = self.link
+            print('link: asked {0:.2f}-{1:.2f} ms latency {2}{3}, got {4:.2f} '
+                  'ms latency {5}'.format(
+                      min_int * _LINK_INTERVAL_MS, max_int * _LINK_INTERVAL_MS,
+                      req_lat, '' if fast else ' (not in OTA mode)',
+                      interval * _LINK_INTERVAL_MS, lat))
+        print('{0} chunks, {1} writes ({2} resent), {3} bytes on the wire'.format(
+            len(self.chunks), self.writes, self.writes - len(self.first_sent),
+            self.wire_bytes))
+        print('{0:.3f} s, {1:.0f} image B/s, {2:.0f} wire B/s'.format(
+            elapsed, image_bytes / elapsed, self.wire_bytes / elapsed))
+        lats = sorted(self.latency.values())
+        if lats:
+            print('chunk latency ms: min {0:.2f} avg {1:.2f} p95 {2:.2f} '
+                  'max {3:.2f} ({4} acked)'.format(
+                      lats[0] * 1000, sum(lats) / len(lats) * 1000,
+                      lats[int(0.95 * (len(lats) - 1))] * 1000,
+                      lats[-1] * 1000, len(lats)))
+
+
+def send_windowed(transport, chunks, window, ack_timeout, stats):
+    num = len(chunks)
+    ack = Ack()
+    stalls = 0
+    end = 0
+    try:
+        while ack.base < num and ack.status != OTA_ACK_DONE:
+            # Aligned windows, so the board acks as the last chunk lands
+            end = min((ack.base // window + 1) * window, num)
+            for idx in range(ack.base, end):
+                if not ack.has(idx):
+                    stats.sent(idx, transport.now())
+                    transport.write(chunks[idx], response=False)
+
+            new = transport.wait_ack(ack_timeout)
+            if new is None:
+                # the notification may have been dropped
+                new = transport.read_ack()
+            stats.acked(new, transport.now())
+            if new.status == OTA_ACK_ERROR:
+                print('the board dropped the transfer at chunk {0}'
+                      .format(new.base))
+                return False
+            if stats.link is None and new.status != OTA_ACK_DONE:
+                # the board switched to its OTA parameters on chunk 0
+                stats.link = transport.read_link()
+
+            stalls = stalls + 1 if new == ack else 0
+            if stalls >= _MAX_STALLS:
+                print('no progress past chunk {0}'.format(ack.base))
+                return False
+            ack = new
+    except LinkLost:
+        # The board resets as soon as the image is committed
+        if end == num:
+            return True
+        raise
+    return True
+
+
+def send_in_order(transport, chunks, stats):
+    for idx, chunk in enumerate(chunks):
+        start = transport.now()
+        stats.sent(idx, start)
+        try:
+            transport.write(chunk, response=True)
+        except LinkLost:
+            if idx + 1 == len(chunks):
+                return True
+            raise
+        stats.latency[idx] = transport.now() - start
+        stats.end = transport.now()
+    return True
+
+
+def load_stream(source):
+    """
+    Returns the byte stream the board receives and the container to close
+    afterwards. A directory of prepare_blobs.py chunks has no stream.
+    """
+    if os.path.isdir(source):
+        return None, None
+
+    if source.endswith('.json'):
+        with open(source) as f:
+            return ota_container.stream_from_json(json.load(f)), None
+
+    # Chunks are cut from the mapped file as they go out
+    container = ota_container.OTAContainer(source)
+    return container.stream, container
+
+
+def load_chunks(source, stream, chunk_payload):
+    """Returns the chunks carrying stream, or the ones in a directory."""
+    if stream is not None:
+        return prepare_blobs.StreamChunks(stream, chunk_payload)
+
+    names = [n for n in os.listdir(source) if re.match(r'ota\.chunk\.\d+$', n)]
+    names.sort(key=lambda n: int(n.rsplit('.', 1)[1]))
+    chunks = []
+    for name in names:
+        with open(os.path.join(source, name)) as f:
+            chunks.append(bytes.fromhex(f.read().strip()))
+    return chunks
+
+
+def resume_stream(stream, point):
+    """
+    Returns the stream to send and the image offset it continues from. When
+    the board's resume point (offset, crc) matches the start of this image,
+    the stream keeps the header and the CRC trailer but skips the image
+    bytes the board already holds.
+    """
+    offset, crc = point
+    image = stream[OTA_HEADER_SIZE:-4]
+    if not 0 < offset < len(image) or zlib.crc32(image[:offset]) != crc:
+        return stream, 0
+    return (bytes(stream[:OTA_HEADER_SIZE]) +
+            bytes(stream[OTA_HEADER_SIZE + offset:])), offset
+
+
+def wait_swap(transport, swaps):
+    """
+    Returns (swapUs, stopUs, rollbacks, rollbackRc, trial) from 0xFFFA once
+    the board has swapped to the new image, None if it reset instead. swaps
+    is the count read before. Raises Refused if the board turned the image
+    down at its CRC check.
+    """
+    deadline = transport.now() + _SWAP_TIMEOUT
+    try:
+        while transport.now() < deadline:
+            swap = transport.read_swap()
+            if swap[0] != swaps:
+                return swap[1:]
+            if transport.read_ack().status == OTA_ACK_ERROR:
+                raise Refused('the image failed its CRC check')
+    except LinkLost:
+        pass
+    return None
+
+
+def check_mock_image(transport):
+    image = transport.image
+    if image is None or len(image) < OTA_HEADER_SIZE + 4:
+        return False
+    _, size = struct.unpack_from('<HH', image)
+    if len(image) != OTA_HEADER_SIZE + size + 4:
+        return False
+    data, trailer = image[OTA_HEADER_SIZE:-4], image[-4:]
+    return struct.unpack('<L', trailer)[0] == zlib.crc32(data)
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        'source',
+        type=str,
+        help='OTA container, legacy ota.json, or a directory of '
+             'prepare_blobs.py chunks',
+    )
+    parser.add_argument(
+        'mac',
+        type=str,
+        nargs='?',
+        help='Board address, not needed with --mock',
+    )
+    parser.add_argument(
+        '--mtu',
+        type=int,
+        default=247,
+        help='ATT MTU to request (0 keeps the default)',
+    )
+    parser.add_argument(
+        '--chunk-payload',
+        type=int,
+        default=0,
+        help='Image bytes per chunk, default is what the board reports',
+    )
+    parser.add_argument(
+        '--ack-timeout',
+        type=float,
+        default=_ACK_TIMEOUT,
+        help='Seconds to wait for an ack before reading it instead',
+    )
+    parser.add_argument(
+        '--in-order',
+        action='store_true',
+        help='One write request per chunk, no window (the push_ota.sh way)',
+    )
+    parser.add_argument(
+        '--delta-from',
+        type=str,
+        help='Image the board runs; only the changes from it are sent',
+    )
+    parser.add_argument(
+        '--compress',
+        action='store_true',
+        help='Send the image compressed',
+    )
+    parser.add_argument(
+        '--sparse',
+        action='store_true',
+        help='Send runs of erased bytes as single ops, and nothing else '
+             'compressed',
+    )
+    parser.add_argument(
+        '--no-resume',
+        action='store_true',
+        help='Send the whole image even if the board holds part of it',
+    )
+    parser.add_argument('-v', '--verbose', action='store_true')
+    mock = parser.add_argument_group('mock board')
+    mock.add_argument('--mock', action='store_true')
+    mock.add_argument('--mock-max-chunk', type=int, default=184)
+    mock.add_argument('--mock-interval', type=float, default=7.5,
+                      help='Connection interval, ms')
+    mock.add_argument('--mock-per-event', type=int, default=4,
+                      help='Write commands per connection event')
+    mock.add_argument('--mock-loss', type=float, default=0.,
+                      help='Fraction of write commands dropped')
+    mock.add_argument('--mock-seed', type=int, default=0)
+    mock.add_argument('--mock-resume', type=int, default=0,
+                      help='Image bytes left on the board by an earlier '
+                           'download')
+    mock.add_argument('--mock-reset', action='store_true',
+                      help='The board resets into the image instead of '
+                           'swapping to it')
+    mock.add_argument('--mock-zone', type=int, default=0,
+                      help='Zone the board takes images linked for')
+    mock.add_argument('--mock-corrupt', action='store_true',
+                      help='Flip a byte of the image on the board, which '
+                           'then fails its CRC check')
+    opts = parser.parse_args()
+    if not opts.mock and not opts.mac:
+        parser.error('a board address is needed without --mock')
+    return opts
+
+
+def main():
+    opts = parse_args()
+
+    if opts.mock:
+        transport = MockTransport(opts.mock_max_chunk, _DEFAULT_WINDOW,
+                                  opts.mock_interval, opts.mock_per_event,
+                                  opts.mock_loss, opts.mock_seed,
+                                  opts.mock_reset, opts.mock_zone,
+                                  opts.mock_corrupt)
+    else:
+        transport = BluepyTransport(opts.mac, opts.mtu)
+
+    window = _DEFAULT_WINDOW
+    chunk_payload = opts.chunk_payload
+    caps = transport.read_caps()
+    if caps is not None:
+        print('board takes {0} bytes per chunk, window {1}'.format(*caps[:2]))
+        window = caps[1]
+        if not chunk_payload:
+            chunk_payload = caps[0]
+    if not chunk_payload:
+        chunk_payload = prepare_blobs._CHUNK_PAYLOAD_SIZE
+
+    stream, container = load_stream(opts.source)
+    encoding = ota_container.OTA_ENC_RAW
+    if container is not None:
+        encoding = container.encoding
+    old = None
+    if opts.delta_from:
+        old = ota_delta.load_payload(opts.delta_from)
+    if opts.mock:
+        transport.active = old
+        if stream is not None and encoding == ota_container.OTA_ENC_RAW:
+            transport.preload(stream, opts.mock_resume)
+
+    offset = 0
+    point = transport.read_resume()
+    if point is not None:
+        raw = stream is not None and encoding == ota_container.OTA_ENC_RAW
+        if raw and not opts.no_resume:
+            resumed, offset = resume_stream(stream, point)
+        if raw and old is not None:
+            full = len(stream) - offset
+            stream = ota_delta.delta_stream(stream, old, offset)
+            encoding = ota_container.OTA_ENC_DELTA
+            print('delta of {0} bytes instead of {1}'.format(len(stream), full))
+        elif raw and opts.sparse:
+            full = len(stream) - offset
+            stream = ota_compress.sparse_stream(stream, offset)
+            encoding = ota_container.OTA_ENC_SPARSE
+            print('sparse stream of {0} bytes from {1}'.format(len(stream), full))
+        elif raw and opts.compress:
+            full = len(stream) - offset
+            stream = ota_compress.lz_stream(stream, offset)
+            encoding = ota_container.OTA_ENC_LZ
+            print('compressed to {0} bytes from {1}'.format(len(stream), full))
+        elif offset:
+            stream = resumed
+        # Starts a new transfer on the board, continuing only on a match
+        transport.write_resume(offset, point[1] if offset else 0, encoding)
+        if offset:
+            print('board holds {0} image bytes, sending the rest'.format(offset))
+    elif (encoding != ota_container.OTA_ENC_RAW or old is not None or
+          opts.compress or opts.sparse):
+        print('the board only takes full images')
+        sys.exit(1)
+
+    chunks = load_chunks(opts.source, stream, chunk_payload)
+    stats = Stats(chunks)
+    swaps = transport.read_swap()
+    swap = None
+    try:
+        if opts.in_order:
+            ok = send_in_order(transport, chunks, stats)
+        else:
+            ok = send_windowed(transport, chunks, window, opts.ack_timeout,
+                               stats)
+        if ok and swaps is not None:
+            swap = wait_swap(transport, swaps[0])
+    except Refused as e:
+        print('the board refused the image: {0}'.format(e))
+        ok = False
+    except LinkLost as e:
+        print('link lost: {0}'.format(e))
+        ok = False
+    finally:
+        transport.close()
+
+    stats.report(opts.verbose)
+    if swap is not None:
+        print('board swapped to the image in {0:.2f} ms, {1:.2f} ms of it '
+              'stopping the old one'.format(swap[0] / 1000., swap[1] / 1000.))
+        if swap[4]:
+            print('the image runs on trial until it calls ota_confirm()')
+    elif ok and swaps is not None:
+        print('board resets into the image')
+    if opts.mock and ok:
+        ok = check_mock_image(transport)
+        print('mock board image {0}'.format('verified' if ok else 'CORRUPT'))
+    if container is not None:
+        container.close()
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
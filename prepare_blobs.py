@@ -1,75 +1,97 @@
 #!/usr/bin/python3
+import argparse
 import json
 import math
 import os
-import sys
 import shutil
 import struct
 
+import ota_container
+
 _DEST_DIR = './ota_blobs'
 _CHUNK_SIZE = 80
-_CHUNK_OVERHEAD = 12
+_CHUNK_OVERHEAD = 16
 _CHUNK_PAYLOAD_SIZE = _CHUNK_SIZE - _CHUNK_OVERHEAD
-OTA_MAGIC = 0xdabad000
+# Version 2 chunk header: 32-bit total size, 16-bit chunk counters
+OTA_MAGIC = 0xdabad002
 
 
 def create_chunk(total_size, cur_chunk, num_chunks, csum, chunk_len, payload):
-    return to_hex(
-        struct.pack(
-            '<LHBBHH',
-            OTA_MAGIC,
-            total_size,
-            cur_chunk,
-            num_chunks,
-            csum,
-            chunk_len,
-        ),
+    return struct.pack(
+        '<LLHHHH',
+        OTA_MAGIC,
+        total_size,
+        cur_chunk,
+        num_chunks,
+        csum,
+        chunk_len,
     ) + payload
 
 
-def to_hex(x):
-    return ''.join(
-        (
-            '{0:02x}'.format(b) for b in x
-        ),
-    )
+def chunk_csum(chunk):
+    return 0
 
 
-def iter_chunks(data):
-    while data:
-        chunk = data[:_CHUNK_PAYLOAD_SIZE * 2]
-        data = data[_CHUNK_PAYLOAD_SIZE * 2:]
-        yield chunk
+class StreamChunks(object):
+    """
+    The chunks carrying a stream from ota_container, each one cut out when
+    it is asked for, so a mapped container is never copied as a whole.
+    """
 
+    def __init__(self, stream, chunk_payload=_CHUNK_PAYLOAD_SIZE):
+        self._stream = stream
+        self._payload = chunk_payload
+        self._num_chunks = int(math.ceil(len(stream) / chunk_payload))
 
-def chunk_csum(chunk):
-    return 0
-
+    def __len__(self):
+        return self._num_chunks
 
-def dump_load(dest, off, size):
-    return struct.pack('<LHH', dest, off, size)
+    def __getitem__(self, i):
+        if not 0 <= i < self._num_chunks:
+            raise IndexError(i)
+        chunk = self._stream[i * self._payload:(i + 1) * self._payload]
+        return create_chunk(
+            len(self._stream),
+            i,
+            self._num_chunks,
+            chunk_csum(chunk),
+            len(chunk),
+            bytes(chunk),
+        )
 
 
-def dump_metadata(ota):
-    res = struct.pack('<HH', ota['entrypoint'], int(len(ota['data']) / 2))
-    for i in range(3):
-        try:
-            l = ota['loads'][i]
-            load = (l['dest'], l['offset'], l['len'])
-        except IndexError:
-            load = (0, 0, 0)
-        res += dump_load(*load)
-    return to_hex(res)
+def build_chunks(stream, chunk_payload=_CHUNK_PAYLOAD_SIZE):
+    """Returns all the chunks carrying a stream from ota_container."""
+    return list(StreamChunks(stream, chunk_payload))
 
 
-def main():
-    with open(sys.argv[1]) as f:
-        ota = json.load(f)
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        'image',
+        type=str,
+        help='OTA container, or a legacy ota.json, written by extract_ota.py',
+    )
+    parser.add_argument(
+        '--chunk-payload',
+        type=int,
+        default=_CHUNK_PAYLOAD_SIZE,
+        help='Image bytes per chunk. The board reports its limit for the '
+             'current connection in maxChunk of characteristic 0xFFF7.',
+        required=False,
+    )
+    return parser.parse_args()
 
-    data = dump_metadata(ota) + ota['data']
-    total_size = int(len(data) / 2)
 
-    num_chunks = int(math.ceil(total_size / _CHUNK_PAYLOAD_SIZE))
+def main():
+    opts = parse_args()
+    if opts.image.endswith('.json'):
+        with open(opts.image) as f:
+            stream = ota_container.stream_from_json(json.load(f))
+        chunks = build_chunks(stream, opts.chunk_payload)
+    else:
+        with ota_container.OTAContainer(opts.image) as c:
+            chunks = build_chunks(c.stream, opts.chunk_payload)
 
     if os.path.isdir(_DEST_DIR):
         shutil.rmtree(_DEST_DIR)
@@ -77,17 +99,10 @@ def main():
     os.mkdir(_DEST_DIR)
     os.chdir(_DEST_DIR)
 
-    for i, chunk in enumerate(iter_chunks(data)):
-        res = create_chunk(
-            total_size,
-            i,
-            num_chunks,
-            chunk_csum(chunk),
-            int(len(chunk) / 2),
-            chunk,
-        )
+    # gatttool takes the value as hex on its command line
+    for i, res in enumerate(chunks):
         with open('ota.chunk.{0}'.format(i), 'w') as f:
-            f.write(res)
+            f.write(res.hex())
 
 if __name__ == '__main__':
     main()